@@ -0,0 +1,455 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+Microbenchmarks over a copy of a disk image. Each benchmark prints one
+JSON object per line on stdout, so runs can be compared by a script;
+whatever the fs and disk layers print goes to stderr instead. The image
+is mounted as shipped for the mount benchmark and then reformatted, so
+never point this at an image you want to keep.
+*/
+
+#define BENCH_OPS 1000		//operations per benchmark, where the disk allows
+#define BENCH_COPIES 20		//passes of the copyin/copyout benchmarks
+#define BENCH_MOUNTS 200
+#define BENCH_CHUNK 16384	//the shell's copyin/copyout buffer
+#define BENCH_SEED 1
+
+struct bench {
+	const char *name;
+	int size;		//bytes per operation, 0 if it moves no data
+	int ops;
+	long bytes;
+	double *latency;	//seconds per operation
+	double elapsed;		//time spent between bench_resume and bench_pause
+	int ios;		//block I/Os done in that time
+	double resumed;
+	int resumed_ios;
+};
+
+static FILE *results;
+static const char *image;
+static char *buffer;
+static int capacity;	//largest file the formatted image holds
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int block_ios()
+{
+	return disk_read_count() + disk_write_count();
+}
+
+static void bench_start( struct bench *b, const char *name, int size, int maxops )
+{
+	memset(b,0,sizeof(*b));
+	b->name = name;
+	b->size = size;
+	b->latency = malloc(maxops*sizeof(double));
+	if(!b->latency) {
+		fprintf(stderr,"bench: out of memory\n");
+		exit(1);
+	}
+}
+
+//only the time and I/O between these two count towards a benchmark
+static void bench_resume( struct bench *b )
+{
+	b->resumed_ios = block_ios();
+	b->resumed = now();
+}
+
+static void bench_pause( struct bench *b )
+{
+	b->elapsed += now() - b->resumed;
+	b->ios += block_ios() - b->resumed_ios;
+}
+
+//record one operation that began at start and moved bytes
+static void bench_op( struct bench *b, double start, long bytes )
+{
+	b->latency[b->ops++] = now() - start;
+	b->bytes += bytes;
+}
+
+static int latency_compare( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile( struct bench *b, int p )
+{
+	if(!b->ops) return 0;
+	return b->latency[(b->ops - 1) * p / 100];
+}
+
+static void bench_end( struct bench *b )
+{
+	qsort(b->latency,b->ops,sizeof(double),latency_compare);
+
+	fprintf(results,"{\"image\": \"%s\", \"benchmark\": \"%s\", \"size\": %d, \"ops\": %d, "
+		"\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		"\"p50_us\": %.2f, \"p99_us\": %.2f, \"ios_per_op\": %.3f}\n",
+		image,b->name,b->size,b->ops,b->elapsed,
+		b->elapsed > 0 ? b->ops / b->elapsed : 0,
+		b->elapsed > 0 ? b->bytes / b->elapsed / (1 << 20) : 0,
+		percentile(b,50) * 1e6,percentile(b,99) * 1e6,
+		b->ops ? (double)b->ios / b->ops : 0);
+	fflush(results);
+	free(b->latency);
+}
+
+static void bench_mount()
+{
+	struct bench b;
+
+	bench_start(&b,"mount",0,BENCH_MOUNTS);
+	for(int i=0;i<BENCH_MOUNTS;i++) {
+		bench_resume(&b);
+		double start = now();
+		int result = fs_mount();
+		if(result) bench_op(&b,start,0);
+		bench_pause(&b);
+		if(!result) break;
+		fs_unmount();
+	}
+	bench_end(&b);
+}
+
+static void bench_create_delete()
+{
+	struct bench create, delete;
+	int *inodes = malloc(BENCH_OPS*sizeof(int));
+	int n = 0, total = 0;
+
+	if(!inodes) return;
+
+	//create as many as will fit, delete them all, and again until enough
+	bench_start(&create,"create",0,BENCH_OPS);
+	bench_start(&delete,"delete",0,BENCH_OPS);
+	while(total<BENCH_OPS) {
+		double start;
+		bench_resume(&create);
+		for(n=0;total+n<BENCH_OPS;n++) {
+			start = now();
+			inodes[n] = fs_create();
+			if(inodes[n]<=0) break;
+			bench_op(&create,start,0);
+		}
+		fs_sync();
+		bench_pause(&create);
+		if(!n) break;
+
+		bench_resume(&delete);
+		for(int i=0;i<n;i++) {
+			start = now();
+			fs_delete(inodes[i]);
+			bench_op(&delete,start,0);
+		}
+		fs_sync();
+		bench_pause(&delete);
+		total += n;
+	}
+
+	bench_end(&create);
+	bench_end(&delete);
+	free(inodes);
+}
+
+//fill a fresh file until the disk is full to find out how much fits
+static int measure_capacity()
+{
+	int inumber = fs_create(), fd, offset = 0, result;
+
+	if(inumber<=0) return 0;
+	fd = fs_open(inumber);
+	if(fd<0) return 0;
+	memset(buffer,'c',BENCH_CHUNK);
+	while((result = fs_pwrite(fd,buffer,BENCH_CHUNK,offset))>0) {
+		offset += result;
+		if(result<BENCH_CHUNK) break;
+	}
+	fs_close(fd);
+	fs_sync();
+
+	offset = fs_getsize(inumber);
+	fs_delete(inumber);
+	fs_sync();
+	return offset > 0 ? offset : 0;
+}
+
+static void bench_seq_write( int size )
+{
+	struct bench b;
+
+	bench_start(&b,"seq_write",size,BENCH_OPS);
+	while(b.ops<BENCH_OPS) {
+		int inumber = fs_create(), fd, offset, done = b.ops;
+		if(inumber<=0) break;
+		fd = fs_open(inumber);
+		if(fd<0) break;
+		bench_resume(&b);
+		for(offset=0;offset<capacity && b.ops<BENCH_OPS;offset+=size) {
+			int n = (capacity-offset < size) ? capacity-offset : size;
+			double start = now();
+			if(fs_pwrite(fd,buffer,n,offset)!=n) break;
+			bench_op(&b,start,n);
+		}
+		fs_close(fd);
+		fs_sync();
+		bench_pause(&b);
+		fs_delete(inumber);
+		if(b.ops==done) break;
+	}
+	bench_end(&b);
+}
+
+//leave a file of capacity bytes behind for the read benchmarks
+static int make_file()
+{
+	int inumber = fs_create();
+	if(inumber<=0) return 0;
+	for(int i=0;i<BENCH_CHUNK;i++) buffer[i] = i * 7 + i / 4096;
+	for(int offset=0;offset<capacity;offset+=BENCH_CHUNK) {
+		int n = (capacity-offset < BENCH_CHUNK) ? capacity-offset : BENCH_CHUNK;
+		fs_write(inumber,buffer,n,offset);
+	}
+	fs_sync();
+	return inumber;
+}
+
+static void bench_seq_read( int inumber, int size )
+{
+	struct bench b;
+	int fd = fs_open(inumber);
+
+	if(fd<0) return;
+	bench_start(&b,"seq_read",size,BENCH_OPS);
+	bench_resume(&b);
+	while(b.ops<BENCH_OPS) {
+		int done = b.ops;
+		for(int offset=0;offset<capacity && b.ops<BENCH_OPS;offset+=size) {
+			double start = now();
+			int n = fs_pread(fd,buffer,size,offset);
+			if(n<=0) break;
+			bench_op(&b,start,n);
+		}
+		if(b.ops==done) break;
+	}
+	bench_pause(&b);
+	bench_end(&b);
+	fs_close(fd);
+}
+
+static void bench_random( int inumber, int size, int write )
+{
+	struct bench b;
+	unsigned seed = BENCH_SEED;
+	int fd = fs_open(inumber), range = capacity - size;
+
+	if(fd<0 || range<0) {
+		if(fd>=0) fs_close(fd);
+		return;
+	}
+	bench_start(&b,write ? "random_write" : "random_read",size,BENCH_OPS);
+	bench_resume(&b);
+	while(b.ops<BENCH_OPS) {
+		int offset = range ? rand_r(&seed) % range : 0;
+		double start = now();
+		int n = write ? fs_pwrite(fd,buffer,size,offset) : fs_pread(fd,buffer,size,offset);
+		if(n!=size) break;
+		bench_op(&b,start,n);
+	}
+	if(write) fs_sync();
+	bench_pause(&b);
+	bench_end(&b);
+	fs_close(fd);
+}
+
+/*
+Copy a host file in and back out in BENCH_CHUNK pieces, one call at a
+time. The shell's copyin and copyout overlap host and filesystem I/O,
+so they can be faster than this.
+*/
+static void bench_copy( const char *hostfile )
+{
+	struct bench in, out;
+	FILE *file;
+	int inumber = 0;
+
+	file = fopen(hostfile,"w");
+	if(!file) {
+		fprintf(stderr,"bench: couldn't open %s: %s\n",hostfile,strerror(errno));
+		return;
+	}
+	for(int offset=0;offset<capacity;offset+=BENCH_CHUNK) {
+		int n = (capacity-offset < BENCH_CHUNK) ? capacity-offset : BENCH_CHUNK;
+		fwrite(buffer,1,n,file);
+	}
+	fclose(file);
+
+	bench_start(&in,"copyin",capacity,BENCH_COPIES);
+	bench_start(&out,"copyout",capacity,BENCH_COPIES);
+	for(int pass=0;pass<BENCH_COPIES;pass++) {
+		int fd, offset = 0, result;
+		double start;
+
+		bench_resume(&in);
+		start = now();
+		inumber = fs_create();
+		if(inumber<=0) {
+			bench_pause(&in);
+			break;
+		}
+		file = fopen(hostfile,"r");
+		fd = fs_open(inumber);
+		if(!file || fd<0) {
+			fprintf(stderr,"bench: copyin of %s failed\n",hostfile);
+			if(file) fclose(file);
+			if(fd>=0) fs_close(fd);
+			fs_delete(inumber);
+			bench_pause(&in);
+			break;
+		}
+		while((result = fread(buffer,1,BENCH_CHUNK,file))>0) {
+			if(fs_pwrite(fd,buffer,result,offset)!=result) break;
+			offset += result;
+		}
+		fs_close(fd);
+		fclose(file);
+		fs_sync();
+		bench_op(&in,start,offset);
+		bench_pause(&in);
+
+		bench_resume(&out);
+		start = now();
+		file = fopen(hostfile,"w");
+		fd = fs_open(inumber);
+		if(!file || fd<0) {
+			fprintf(stderr,"bench: copyout to %s failed\n",hostfile);
+			if(file) fclose(file);
+			if(fd>=0) fs_close(fd);
+			fs_delete(inumber);
+			bench_pause(&out);
+			break;
+		}
+		offset = 0;
+		while((result = fs_pread(fd,buffer,BENCH_CHUNK,offset))>0) {
+			fwrite(buffer,1,result,file);
+			offset += result;
+		}
+		fs_close(fd);
+		fclose(file);
+		bench_op(&out,start,offset);
+		bench_pause(&out);
+
+		fs_delete(inumber);
+		fs_sync();
+	}
+
+	bench_end(&in);
+	bench_end(&out);
+	unlink(hostfile);
+}
+
+int main( int argc, char *argv[] )
+{
+	static const int sizes[] = { 512, 4096, 65536 };
+	char hostfile[1024];
+	struct stat info;
+	int cacheblocks=-1, queuedepth=-1, mapped=0, inumber, result;
+
+	for(int i=2;i<argc;i++) {
+		if(!strcmp(argv[i],"-m")) {
+			mapped = 1;
+		} else if(!strcmp(argv[i],"-c") && i+1<argc) {
+			cacheblocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-r") && i+1<argc) {
+			fs_set_readahead(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-w") && i+1<argc) {
+			fs_set_writeback(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-q") && i+1<argc) {
+			queuedepth = atoi(argv[++i]);
+		} else {
+			argc = 0;
+			break;
+		}
+	}
+
+	if(argc<2) {
+		fprintf(stderr,"use: %s <diskfile> [-c cacheblocks] [-r readahead] [-w writebehind] [-q queuedepth] [-m]\n",argv[0]);
+		return 1;
+	}
+
+	image = argv[1];
+	if(stat(image,&info)<0 || info.st_size<DISK_BLOCK_SIZE) {
+		fprintf(stderr,"couldn't use %s: %s\n",image,strerror(errno ? errno : EINVAL));
+		return 1;
+	}
+
+	//results keep stdout to themselves
+	results = fdopen(dup(1),"w");
+	dup2(2,1);
+	buffer = malloc(sizes[2] > BENCH_CHUNK ? sizes[2] : BENCH_CHUNK);
+	if(!results || !buffer) {
+		fprintf(stderr,"bench: out of memory\n");
+		return 1;
+	}
+
+	if(mapped) {
+		result = disk_init_mapped(image,info.st_size / DISK_BLOCK_SIZE);
+	} else {
+		result = disk_init(image,info.st_size / DISK_BLOCK_SIZE);
+	}
+	if(!result) {
+		fprintf(stderr,"couldn't initialize %s: %s\n",image,strerror(errno));
+		return 1;
+	}
+	if(cacheblocks>=0) disk_cache_resize(cacheblocks);
+	if(queuedepth>=0) disk_set_queue_depth(queuedepth);
+
+	bench_mount();
+
+	if(!fs_format() || !fs_mount()) {
+		fprintf(stderr,"bench: couldn't format %s\n",image);
+		disk_close();
+		return 1;
+	}
+
+	bench_create_delete();
+
+	capacity = measure_capacity();
+	if(capacity>0) {
+		for(int i=0;i<3;i++) bench_seq_write(sizes[i]);
+
+		inumber = make_file();
+		if(inumber>0) {
+			for(int i=0;i<3;i++) bench_seq_read(inumber,sizes[i]);
+			bench_random(inumber,4096,0);
+			bench_random(inumber,4096,1);
+			fs_delete(inumber);
+			fs_sync();
+		}
+
+		snprintf(hostfile,sizeof(hostfile),"%s.copy",image);
+		bench_copy(hostfile);
+	}
+
+	fs_unmount();
+	disk_close();
+	fclose(results);
+	return 0;
+}
@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "dir.h"
+
+#define DIR_MAGIC          0x44495248
+#define DIR_TABLE_BLOCKS   64
+#define DIR_TABLE_SLOTS    (DISK_BLOCK_SIZE / sizeof(int))
+#define DIR_MAX_DEPTH      16	//DIR_TABLE_BLOCKS * DIR_TABLE_SLOTS buckets
+#define DIR_BUCKET_START   (1 + DIR_TABLE_BLOCKS)
+#define DIR_BUCKET_ENTRIES 63
+
+/*
+A directory is an ordinary file holding an extendible hash table of
+its entries. Block 0 of the file is a header, blocks 1 to
+DIR_TABLE_BLOCKS hold the table, and the buckets follow, one block
+each, in the order they were made. An entry lives in the bucket the
+table slot for the low depth bits of its name's hash points at, so a
+lookup reads the header, one table block and one bucket, however big
+the directory is.
+
+A full bucket splits on the next bit of the hash. Its entries with
+that bit set move to a new bucket at the end of the file, and the
+table slots that now belong to it are pointed there. If the bucket
+already used every bit the table does, the table doubles first by
+copying it onto its upper half. The table blocks past the ones in use
+are holes, so a small directory costs three blocks. Buckets are never
+merged back: removing an entry only frees its slot.
+
+The root directory is made the first time a path is used, and its
+inode kept in the superblock. Paths are resolved from the root one
+component at a time, whether or not they start with a slash. The
+directory calls are serialized by dir_lock; the fs calls underneath
+may still be made from other threads. Directory blocks are file data,
+so like any other file contents they are not journaled.
+*/
+
+struct dir_header {
+	int magic;
+	int depth;	//bits of the hash the table is indexed by
+	int nentries;
+	int nbuckets;
+};
+
+struct dir_entry {
+	int inumber;
+	int isdir;
+	char name[DIR_NAME_MAX + 1];
+};
+
+struct dir_bucket {
+	int depth;	//bits of the hash its entries all share
+	int count;
+	int unused[14];
+	struct dir_entry entries[DIR_BUCKET_ENTRIES];
+};
+
+union dir_block {
+	struct dir_header header;
+	struct dir_bucket bucket;
+	int table[DIR_TABLE_SLOTS];
+	char data[DISK_BLOCK_SIZE];
+};
+
+//an open directory and a copy of its header
+struct dir {
+	int inumber;
+	int fd;
+	struct dir_header header;
+};
+
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//FNV-1a, as the journal uses for its checksums
+static uint32_t name_hash( const char *name )
+{
+	uint32_t h = 2166136261u;
+
+	for(; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int block_read( struct dir *d, int fblock, union dir_block *b )
+{
+	return fs_pread(d->fd, b->data, DISK_BLOCK_SIZE, fblock * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+static int block_write( struct dir *d, int fblock, union dir_block *b )
+{
+	return fs_pwrite(d->fd, b->data, DISK_BLOCK_SIZE, fblock * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+static int header_save( struct dir *d )
+{
+	union dir_block b;
+
+	memset(b.data, 0, sizeof(b.data));
+	b.header = d->header;
+	return block_write(d, 0, &b);
+}
+
+static int dir_open( int inumber, struct dir *d )
+{
+	union dir_block b;
+
+	d->inumber = inumber;
+	d->fd = fs_open(inumber);
+	if(d->fd < 0) return 0;
+	if(!block_read(d, 0, &b) || b.header.magic != DIR_MAGIC) {
+		printf("dir: inode %d is not a directory\n", inumber);
+		fs_close(d->fd);
+		return 0;
+	}
+	d->header = b.header;
+	return 1;
+}
+
+//does inumber hold a directory? Says nothing about invalid inodes
+int dir_isdir( int inumber )
+{
+	struct dir_header header;
+
+	return fs_read(inumber, (char *)&header, sizeof(header), 0) == sizeof(header) && header.magic == DIR_MAGIC;
+}
+
+static void dir_close( struct dir *d )
+{
+	fs_close(d->fd);
+}
+
+//make an empty directory: the header, the first table block and one bucket
+static int dir_make()
+{
+	union dir_block b;
+	struct dir d;
+
+	int inumber = fs_create();
+	if(!inumber) return 0;
+	d.inumber = inumber;
+	d.fd = fs_open(inumber);
+	if(d.fd < 0) {
+		fs_delete(inumber);
+		return 0;
+	}
+
+	memset(&d.header, 0, sizeof(d.header));
+	d.header.magic = DIR_MAGIC;
+	d.header.nbuckets = 1;
+	memset(b.data, 0, sizeof(b.data));
+	b.table[0] = DIR_BUCKET_START;
+	int ok = block_write(&d, 1, &b);
+	memset(b.data, 0, sizeof(b.data));
+	ok = ok && block_write(&d, DIR_BUCKET_START, &b) && header_save(&d);
+	fs_close(d.fd);
+
+	if(!ok) {
+		fs_delete(inumber);
+		return 0;
+	}
+	return inumber;
+}
+
+static int root_open( struct dir *d )
+{
+	int root = fs_getroot();
+
+	if(!root) {
+		root = dir_make();
+		if(!root || !fs_setroot(root)) return 0;
+	}
+	return dir_open(root, d);
+}
+
+//the bucket block table slot idx points at, or 0
+static int table_get( struct dir *d, int idx )
+{
+	union dir_block b;
+
+	if(!block_read(d, 1 + idx / DIR_TABLE_SLOTS, &b)) return 0;
+	return b.table[idx % DIR_TABLE_SLOTS];
+}
+
+static int table_double( struct dir *d )
+{
+	union dir_block b;
+	int n = 1 << d->header.depth;
+
+	if(n < DIR_TABLE_SLOTS) {
+		if(!block_read(d, 1, &b)) return 0;
+		memcpy(&b.table[n], &b.table[0], n * sizeof(int));
+		if(!block_write(d, 1, &b)) return 0;
+	} else {
+		for(int k = 0; k < n / DIR_TABLE_SLOTS; k++) {
+			if(!block_read(d, 1 + k, &b) || !block_write(d, 1 + n / DIR_TABLE_SLOTS + k, &b)) return 0;
+		}
+	}
+	d->header.depth++;
+	return header_save(d);
+}
+
+/*
+Read the bucket name hashes to into b and its file block into fblock.
+Returns the slot holding name, -1 if it is not there, or -2 if the
+directory could not be read.
+*/
+static int bucket_find( struct dir *d, const char *name, int *fblock, union dir_block *b )
+{
+	uint32_t h = name_hash(name);
+
+	*fblock = table_get(d, h & ((1u << d->header.depth) - 1));
+	if(*fblock < DIR_BUCKET_START || !block_read(d, *fblock, b)) return -2;
+	if(b->bucket.count > DIR_BUCKET_ENTRIES) b->bucket.count = DIR_BUCKET_ENTRIES;
+	for(int i = 0; i < b->bucket.count; i++) {
+		if(!strncmp(b->bucket.entries[i].name, name, DIR_NAME_MAX + 1)) return i;
+	}
+	return -1;
+}
+
+//split the full bucket in b, found through table slot idx
+static int bucket_split( struct dir *d, int idx, int fblock, union dir_block *b )
+{
+	union dir_block high, t;
+	int depth = b->bucket.depth;
+	int newblock = DIR_BUCKET_START + d->header.nbuckets;
+
+	if(depth >= DIR_MAX_DEPTH) {
+		printf("dir: directory is full\n");
+		return 0;
+	}
+	if(depth >= d->header.depth && !table_double(d)) return 0;
+
+	memset(high.data, 0, sizeof(high.data));
+	int kept = 0;
+	for(int i = 0; i < b->bucket.count; i++) {
+		struct dir_entry *e = &b->bucket.entries[i];
+		if((name_hash(e->name) >> depth) & 1) high.bucket.entries[high.bucket.count++] = *e;
+		else b->bucket.entries[kept++] = *e;
+	}
+	memset(&b->bucket.entries[kept], 0, (b->bucket.count - kept) * sizeof(struct dir_entry));
+	b->bucket.count = kept;
+	b->bucket.depth = high.bucket.depth = depth + 1;
+	if(!block_write(d, newblock, &high)) return 0;
+	d->header.nbuckets++;
+
+	//every slot that shares the low depth bits and has the next one set
+	int loaded = 0;
+	for(int j = (idx & ((1 << depth) - 1)) | (1 << depth); j < 1 << d->header.depth; j += 2 << depth) {
+		int tblock = 1 + j / DIR_TABLE_SLOTS;
+		if(tblock != loaded) {
+			if(loaded && !block_write(d, loaded, &t)) return 0;
+			if(!block_read(d, tblock, &t)) return 0;
+			loaded = tblock;
+		}
+		t.table[j % DIR_TABLE_SLOTS] = newblock;
+	}
+	if(loaded && !block_write(d, loaded, &t)) return 0;
+
+	return block_write(d, fblock, b) && header_save(d);
+}
+
+static int entry_insert( struct dir *d, const char *name, int inumber, int isdir )
+{
+	union dir_block b;
+	int fblock, slot;
+
+	while((slot = bucket_find(d, name, &fblock, &b)) == -1 && b.bucket.count == DIR_BUCKET_ENTRIES) {
+		if(!bucket_split(d, name_hash(name) & ((1u << d->header.depth) - 1), fblock, &b)) return 0;
+	}
+	if(slot == -2) return 0;
+	if(slot >= 0) {
+		printf("dir: %s already exists\n", name);
+		return 0;
+	}
+
+	struct dir_entry *e = &b.bucket.entries[b.bucket.count++];
+	memset(e, 0, sizeof(*e));
+	e->inumber = inumber;
+	e->isdir = isdir;
+	strcpy(e->name, name);
+	if(!block_write(d, fblock, &b)) return 0;
+	d->header.nentries++;
+	return header_save(d);
+}
+
+//drop the entry in slot of the bucket b, read from fblock
+static int entry_remove( struct dir *d, int fblock, union dir_block *b, int slot )
+{
+	b->bucket.entries[slot] = b->bucket.entries[--b->bucket.count];
+	memset(&b->bucket.entries[b->bucket.count], 0, sizeof(struct dir_entry));
+	if(!block_write(d, fblock, b)) return 0;
+	d->header.nentries--;
+	return header_save(d);
+}
+
+//copy the next component of *path into name; 0 at the end, -1 if it is no good
+static int path_next( const char **path, char *name )
+{
+	const char *p = *path;
+
+	while(*p == '/') p++;
+	if(!*p) return 0;
+	int len = strcspn(p, "/");
+	if(len > DIR_NAME_MAX) {
+		printf("dir: name too long: %.*s\n", len, p);
+		return -1;
+	}
+	memcpy(name, p, len);
+	name[len] = 0;
+	*path = p + len;
+	if(!strcmp(name, ".") || !strcmp(name, "..")) {
+		printf("dir: invalid name: %s\n", name);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+Open the directory holding the last component of path into d and copy
+that component into leaf. Returns 1 if it did, 2 if path names the
+root itself, so d is the root and there is no leaf, or 0 if a
+directory along the way is missing.
+*/
+static int path_parent( const char *path, struct dir *d, char *leaf )
+{
+	char name[DIR_NAME_MAX + 1];
+	union dir_block b;
+	int fblock, r;
+
+	if(!root_open(d)) return 0;
+	r = path_next(&path, leaf);
+	if(r <= 0) {
+		if(!r) return 2;
+		dir_close(d);
+		return 0;
+	}
+	while((r = path_next(&path, name)) > 0) {
+		int slot = bucket_find(d, leaf, &fblock, &b);
+		dir_close(d);
+		if(slot < 0 || !b.bucket.entries[slot].isdir) {
+			if(slot != -2) printf("dir: %s: no such directory\n", leaf);
+			return 0;
+		}
+		if(!dir_open(b.bucket.entries[slot].inumber, d)) return 0;
+		strcpy(leaf, name);
+	}
+	if(r < 0) {
+		dir_close(d);
+		return 0;
+	}
+	return 1;
+}
+
+//open the directory path names
+static int path_open( const char *path, struct dir *d )
+{
+	char name[DIR_NAME_MAX + 1];
+	union dir_block b;
+	int fblock;
+
+	int r = path_parent(path, d, name);
+	if(r != 1) return r;
+	int slot = bucket_find(d, name, &fblock, &b);
+	dir_close(d);
+	if(slot < 0 || !b.bucket.entries[slot].isdir) {
+		if(slot != -2) printf("dir: %s: no such directory\n", name);
+		return 0;
+	}
+	return dir_open(b.bucket.entries[slot].inumber, d);
+}
+
+int dir_lookup( const char *path, int *isdir )
+{
+	char name[DIR_NAME_MAX + 1];
+	union dir_block b;
+	struct dir d;
+	int fblock, inumber = 0;
+
+	pthread_mutex_lock(&dir_lock);
+	int r = path_parent(path, &d, name);
+	if(r == 1) {
+		int slot = bucket_find(&d, name, &fblock, &b);
+		if(slot >= 0) {
+			inumber = b.bucket.entries[slot].inumber;
+			if(isdir) *isdir = b.bucket.entries[slot].isdir;
+		}
+	} else if(r == 2) {
+		inumber = d.inumber;
+		if(isdir) *isdir = 1;
+	}
+	if(r) dir_close(&d);
+	pthread_mutex_unlock(&dir_lock);
+	return inumber;
+}
+
+//give path a new empty file or directory, and return its inode
+static int entry_make( const char *path, int isdir )
+{
+	char name[DIR_NAME_MAX + 1];
+	struct dir d;
+	int inumber = 0;
+
+	pthread_mutex_lock(&dir_lock);
+	int r = path_parent(path, &d, name);
+	if(r == 1) {
+		inumber = isdir ? dir_make() : fs_create();
+		if(inumber && !entry_insert(&d, name, inumber, isdir)) {
+			fs_delete(inumber);
+			inumber = 0;
+		}
+	} else if(r == 2) {
+		printf("dir: / already exists\n");
+	}
+	if(r) dir_close(&d);
+	pthread_mutex_unlock(&dir_lock);
+	return inumber;
+}
+
+int dir_create( const char *path )
+{
+	return entry_make(path, 0);
+}
+
+int dir_mkdir( const char *path )
+{
+	return entry_make(path, 1);
+}
+
+//unlink path and delete its inode; directories have to be empty
+int dir_remove( const char *path )
+{
+	char name[DIR_NAME_MAX + 1];
+	union dir_block b;
+	struct dir d, child;
+	int fblock, result = 0;
+
+	pthread_mutex_lock(&dir_lock);
+	int r = path_parent(path, &d, name);
+	if(r == 1) {
+		int slot = bucket_find(&d, name, &fblock, &b);
+		if(slot == -1) {
+			printf("dir: %s: no such file or directory\n", name);
+		} else if(slot >= 0) {
+			int inumber = b.bucket.entries[slot].inumber;
+			int nentries = 0;
+			if(b.bucket.entries[slot].isdir) {
+				nentries = -1;
+				if(dir_open(inumber, &child)) {
+					nentries = child.header.nentries;
+					dir_close(&child);
+				}
+			}
+			if(nentries > 0) printf("dir: %s is not empty\n", name);
+			else if(!nentries) result = entry_remove(&d, fblock, &b, slot) && fs_delete(inumber);
+		}
+	} else if(r == 2) {
+		printf("dir: cannot remove /\n");
+	}
+	if(r) dir_close(&d);
+	pthread_mutex_unlock(&dir_lock);
+	return result;
+}
+
+/*
+Call visit for every entry of the directory path names, in bucket
+order. visit runs with dir_lock held, so it may not call back into the
+directory layer.
+*/
+int dir_list( const char *path, void (*visit)( void *ctx, const char *name, int inumber, int isdir ), void *ctx )
+{
+	union dir_block b;
+	struct dir d;
+	int result = 1;
+
+	pthread_mutex_lock(&dir_lock);
+	if(!path_open(path, &d)) {
+		pthread_mutex_unlock(&dir_lock);
+		return 0;
+	}
+	for(int i = 0; i < d.header.nbuckets; i++) {
+		if(!block_read(&d, DIR_BUCKET_START + i, &b)) {
+			result = 0;
+			break;
+		}
+		if(b.bucket.count > DIR_BUCKET_ENTRIES) b.bucket.count = DIR_BUCKET_ENTRIES;
+		for(int k = 0; k < b.bucket.count; k++) {
+			visit(ctx, b.bucket.entries[k].name, b.bucket.entries[k].inumber, b.bucket.entries[k].isdir);
+		}
+	}
+	dir_close(&d);
+	pthread_mutex_unlock(&dir_lock);
+	return result;
+}
@@ -0,0 +1,13 @@
+#ifndef DIR_H
+#define DIR_H
+
+#define DIR_NAME_MAX 55
+
+int  dir_lookup( const char *path, int *isdir );
+int  dir_isdir( int inumber );
+int  dir_create( const char *path );
+int  dir_mkdir( const char *path );
+int  dir_remove( const char *path );
+int  dir_list( const char *path, void (*visit)( void *ctx, const char *name, int inumber, int isdir ), void *ctx );
+
+#endif
@@ -3,27 +3,313 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && !defined(DISK_NO_URING)
+#define DISK_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+#define AIO_DEPTH_DEFAULT 32
+#define AIO_DEPTH_MAX     256
+#define AIO_OP_BLOCKS     64
+#define AIO_THREADS       4
+
+//busy value of a slot reserved by disk_reserve but not yet read
+#define PREFETCH_PENDING 2
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+A write-back block cache sits between the callers and the image file.
+Slots are replaced with the CLOCK algorithm, and cache_slot maps a
+block number to the slot holding it (-1 if not cached), so lookups
+never have to scan the cache.
+
+When the image is opened with disk_init_mapped, the whole file is
+mmap'd instead and blocks are served straight out of the mapping.
+The kernel page cache already does the caching there, so the block
+cache is switched off and disk_borrow can hand out pointers into the
+image itself.
+
+All access to the image uses pread/pwrite, so there is no shared file
+position and any number of threads may call into this module at once.
+The cache is guarded by cache_lock, but the lock is dropped while a
+missing block is fetched; the slot is marked busy in the meantime and
+anyone else wanting that block waits on cache_cond.
+
+disk_readv/disk_writev move a run of consecutive blocks to or from a
+list of buffers with a single preadv/pwritev. Runs are treated as
+bulk data and are not added to the cache: a read takes any blocks that
+are already resident (such as ones brought in by disk_prefetch) from
+the cache and fetches the gaps with one request each, and a write
+updates any cached copies in place.
+*/
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	int referenced;
+	int busy;
+	char data[DISK_BLOCK_SIZE];
+};
+
+static int diskfd=-1;
+static char *diskmap=0;
 static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+static atomic_int nreads;
+static atomic_int nwrites;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static struct cache_entry *cache=0;
+static int *cache_slot=0;
+static int cache_size=0;
+static int clock_hand=0;
+static int cache_pending=0;
+static atomic_int nhits;
+static atomic_int nmisses;
+
+static void aio_init();
+static void aio_shutdown();
+static const char * aio_engine();
+
+//every block moved to or from the image is counted here
+static void count_io( int write, int n )
+{
+	if(write) {
+		nwrites += n;
+	} else {
+		nreads += n;
+	}
+	stats_io(n);
+}
+
+static void disk_read_raw( int blocknum, char *data )
+{
+	if(diskmap) {
+		memcpy(data,diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		count_io(0,1);
+		return;
+	}
+
+	if(pread(diskfd,data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		count_io(0,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+static void disk_write_raw( int blocknum, const char *data )
+{
+	if(diskmap) {
+		memcpy(diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+		count_io(1,1);
+		return;
+	}
+
+	if(pwrite(diskfd,data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		count_io(1,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+static void disk_transfer_run( int blocknum, struct iovec *iov, int count, int write )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	ssize_t expected, actual;
+	int n;
+
+	while(count>0) {
+		n = count<IOV_MAX ? count : IOV_MAX;
+		expected = (ssize_t)n*DISK_BLOCK_SIZE;
+
+		if(write) {
+			actual = pwritev(diskfd,iov,n,offset);
+		} else {
+			actual = preadv(diskfd,iov,n,offset);
+		}
+
+		if(actual!=expected) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+
+		count_io(write,n);
+
+		iov += n;
+		count -= n;
+		offset += expected;
+	}
+}
+
+static void cache_writeback( struct cache_entry *e )
+{
+	if(e->blocknum>=0 && e->dirty) {
+		disk_write_raw(e->blocknum,e->data);
+		e->dirty = 0;
+	}
+}
+
+static void cache_free()
+{
+	free(cache);
+	free(cache_slot);
+	cache = 0;
+	cache_slot = 0;
+	cache_size = 0;
+	clock_hand = 0;
+}
+
+static int cache_alloc( int nslots )
+{
+	if(nslots<=0) return 1;
+
+	cache = malloc(nslots*sizeof(struct cache_entry));
+	cache_slot = malloc(nblocks*sizeof(int));
+	if(!cache || !cache_slot) {
+		cache_free();
+		return 0;
+	}
+
+	for(int i=0;i<nslots;i++) {
+		cache[i].blocknum = -1;
+		cache[i].dirty = 0;
+		cache[i].referenced = 0;
+		cache[i].busy = 0;
+	}
+	for(int i=0;i<nblocks;i++) cache_slot[i] = -1;
+
+	cache_size = nslots;
+	return 1;
+}
+
+/*
+Pick a slot for blocknum, writing back whatever was evicted from it.
+Busy slots are skipped; if every slot is busy, wait for one to settle.
+Must be called with cache_lock held.
+*/
+
+static struct cache_entry * cache_victim( int blocknum )
+{
+	struct cache_entry *e;
+	int scanned = 0;
+
+	while(1) {
+		e = &cache[clock_hand];
+		clock_hand = (clock_hand+1)%cache_size;
+		if(e->busy) {
+			if(++scanned>=2*cache_size) {
+				pthread_cond_wait(&cache_cond,&cache_lock);
+				scanned = 0;
+			}
+			continue;
+		}
+		if(e->blocknum>=0 && e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		break;
+	}
+
+	if(e->blocknum>=0) {
+		cache_writeback(e);
+		cache_slot[e->blocknum] = -1;
+	}
+
+	e->blocknum = blocknum;
+	e->dirty = 0;
+	e->referenced = 1;
+	cache_slot[blocknum] = e-cache;
+
+	return e;
+}
+
+/* Find blocknum in the cache, waiting out a fetch in progress. Returns 0 on a miss. */
+
+static struct cache_entry * cache_lookup( int blocknum )
+{
+	struct cache_entry *e;
+
+	while(cache_slot[blocknum]>=0) {
+		e = &cache[cache_slot[blocknum]];
+		if(!e->busy) {
+			e->referenced = 1;
+			return e;
+		}
+		pthread_cond_wait(&cache_cond,&cache_lock);
+	}
+
+	return 0;
+}
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE);
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nhits = 0;
+	nmisses = 0;
+
+	if(!cache_alloc(DISK_CACHE_DEFAULT)) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	aio_init();
+	return 1;
+}
+
+int disk_init_mapped( const char *filename, int n )
+{
+	void *map;
+
+	if(n<=0) return 0;
+	if(!disk_init(filename,n)) return 0;
+
+	//a short image would fault on the first access past its end
+	struct stat st;
+	map = MAP_FAILED;
+	if(!fstat(diskfd,&st) && st.st_size>=(off_t)n*DISK_BLOCK_SIZE) {
+		map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+	}
+	if(map==MAP_FAILED) {
+		aio_shutdown();
+		close(diskfd);
+		diskfd = -1;
+		cache_free();
+		return 0;
+	}
+
+	cache_free();
+	diskmap = map;
+
+	//mapped blocks are a memcpy away, so requests are simply done on submission
+	aio_shutdown();
 
 	return 1;
 }
@@ -33,6 +319,17 @@ int disk_size()
 	return nblocks;
 }
 
+//blocks actually transferred to or from the image so far
+int disk_read_count()
+{
+	return nreads;
+}
+
+int disk_write_count()
+{
+	return nwrites;
+}
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
@@ -53,38 +350,869 @@ static void sanity_check( int blocknum, const void *data )
 
 void disk_read( int blocknum, char *data )
 {
+	struct cache_entry *e;
+	struct stats_timer t;
+
 	sanity_check(blocknum,data);
+	stats_begin(&t);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!cache_size) {
+		disk_read_raw(blocknum,data);
+		stats_end(STATS_DISK_READ,&t,DISK_BLOCK_SIZE);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	e = cache_lookup(blocknum);
+	if(e) {
+		nhits++;
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		e = cache_victim(blocknum);
+		e->busy = 1;
+		pthread_mutex_unlock(&cache_lock);
+
+		disk_read_raw(blocknum,e->data);
+		nmisses++;
+
+		pthread_mutex_lock(&cache_lock);
+		e->busy = 0;
+		pthread_cond_broadcast(&cache_cond);
 	}
+
+	memcpy(data,e->data,DISK_BLOCK_SIZE);
+
+	pthread_mutex_unlock(&cache_lock);
+	stats_end(STATS_DISK_READ,&t,DISK_BLOCK_SIZE);
 }
 
 void disk_write( int blocknum, const char *data )
 {
+	struct cache_entry *e;
+	struct stats_timer t;
+
 	sanity_check(blocknum,data);
+	stats_begin(&t);
+
+	if(!cache_size) {
+		disk_write_raw(blocknum,data);
+		stats_end(STATS_DISK_WRITE,&t,DISK_BLOCK_SIZE);
+		return;
+	}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	pthread_mutex_lock(&cache_lock);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	e = cache_lookup(blocknum);
+	if(e) {
+		nhits++;
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		/* the whole block is overwritten, so there is nothing to fetch */
+		e = cache_victim(blocknum);
+		nmisses++;
+	}
+
+	memcpy(e->data,data,DISK_BLOCK_SIZE);
+	e->dirty = 1;
+
+	pthread_mutex_unlock(&cache_lock);
+	stats_end(STATS_DISK_WRITE,&t,DISK_BLOCK_SIZE);
+}
+
+//copy the resident blocks of a run into data, flagging them in cached
+static void cache_copy_run( int blocknum, char **data, int count, char *cached )
+{
+	int busy;
+
+	if(!cache_size) return;
+
+	pthread_mutex_lock(&cache_lock);
+	do {
+		busy = 0;
+		for(int i=0;i<count;i++) {
+			int slot = cache_slot[blocknum+i];
+			if(slot>=0 && cache[slot].busy) busy = 1;
+		}
+		if(busy) pthread_cond_wait(&cache_cond,&cache_lock);
+	} while(busy);
+
+	for(int i=0;i<count;i++) {
+		int slot = cache_slot[blocknum+i];
+		if(slot>=0) {
+			memcpy(data[i],cache[slot].data,DISK_BLOCK_SIZE);
+			cache[slot].referenced = 1;
+			cached[i] = 1;
+			nhits++;
+		} else {
+			nmisses++;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Bring the resident copies of a run up to date with data; the caller
+writes it out. They stay dirty until cache_clean_run sees the write
+done, so one evicted meanwhile is written back rather than reread stale.
+*/
+static void cache_update_run( int blocknum, const char **data, int count )
+{
+	struct cache_entry *e;
+
+	if(!cache_size) return;
+
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<count;i++) {
+		e = cache_lookup(blocknum+i);
+		if(e) {
+			memcpy(e->data,data[i],DISK_BLOCK_SIZE);
+			e->dirty = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//a run written by cache_update_run's caller is on the image; copies not changed since are clean
+static void cache_clean_run( int blocknum, const struct iovec *iov, int count )
+{
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;cache_size && i<count;i++) {
+		int slot = cache_slot[blocknum+i];
+		if(slot<0 || cache[slot].busy) continue;
+		if(!memcmp(cache[slot].data,iov[i].iov_base,DISK_BLOCK_SIZE)) cache[slot].dirty = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void disk_readv( int blocknum, char **data, int count )
+{
+	struct iovec *iov;
+	struct stats_timer t;
+	char *cached;
+	int first, n;
+
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+	stats_begin(&t);
+
+	if(diskmap) {
+		for(int i=0;i<count;i++) disk_read_raw(blocknum+i,data[i]);
+		stats_end(STATS_DISK_READV,&t,(long)count*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	iov = malloc(count*sizeof(struct iovec));
+	cached = calloc(count,1);
+	if(!iov || !cached) {
+		free(iov);
+		free(cached);
+		for(int i=0;i<count;i++) disk_read(blocknum+i,data[i]);
+		stats_end(STATS_DISK_READV,&t,(long)count*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	cache_copy_run(blocknum,data,count,cached);
+
+	for(int i=0;i<count;i++) {
+		sanity_check(blocknum+i,data[i]);
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+
+	for(first=0;first<count;first+=n) {
+		if(cached[first]) {
+			n = 1;
+			continue;
+		}
+		for(n=1;first+n<count && !cached[first+n];n++);
+		disk_transfer_run(blocknum+first,iov+first,n,0);
+	}
+
+	free(iov);
+	free(cached);
+	stats_end(STATS_DISK_READV,&t,(long)count*DISK_BLOCK_SIZE);
+}
+
+/*
+Readahead is split in two so the slow part can run on another thread.
+disk_reserve claims cache slots for the blocks of a run that are not
+resident and marks them pending; disk_prefetch later reads them in with
+one preadv per gap. A reader that gets to a pending block before the
+prefetch does simply waits for it rather than issuing its own read.
+At most half the cache is ever pending, so readahead never pushes out
+everything else. Every reserved run must be passed to disk_prefetch.
+*/
+
+int disk_reserve( int blocknum, int count )
+{
+	struct cache_entry *e;
+	int i;
+
+	if(diskmap) return count;
+	if(!cache_size || count<=0 || blocknum<0 || blocknum>=nblocks) return 0;
+	if(blocknum+count>nblocks) count = nblocks-blocknum;
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<count;i++) {
+		if(cache_slot[blocknum+i]>=0) continue;
+		if(cache_pending>=cache_size/2) break;
+		e = cache_victim(blocknum+i);
+		e->busy = PREFETCH_PENDING;
+		cache_pending++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return i;
+}
+
+void disk_prefetch( int blocknum, int count )
+{
+	struct cache_entry **slots;
+	struct iovec *iov;
+	int first, n;
+
+	if(count<=0) return;
+
+	if(diskmap) {
+		madvise(diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,(size_t)count*DISK_BLOCK_SIZE,MADV_WILLNEED);
+		return;
+	}
+
+	slots = calloc(count,sizeof(struct cache_entry *));
+	iov = malloc(count*sizeof(struct iovec));
+
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<count;i++) {
+		int slot = cache_slot[blocknum+i];
+		if(slot<0 || cache[slot].busy!=PREFETCH_PENDING) continue;
+		if(!slots || !iov) {
+			//no memory to batch with; fetch it the slow way
+			disk_read_raw(blocknum+i,cache[slot].data);
+			cache[slot].busy = 0;
+			cache_pending--;
+			continue;
+		}
+		slots[i] = &cache[slot];
+		iov[i].iov_base = slots[i]->data;
+		iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	for(first=0;slots && iov && first<count;first+=n) {
+		if(!slots[first]) {
+			n = 1;
+			continue;
+		}
+		for(n=1;first+n<count && slots[first+n];n++);
+		disk_transfer_run(blocknum+first,iov+first,n,0);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;slots && i<count;i++) {
+		if(!slots[i]) continue;
+		slots[i]->busy = 0;
+		cache_pending--;
+	}
+	pthread_cond_broadcast(&cache_cond);
+	pthread_mutex_unlock(&cache_lock);
+
+	free(slots);
+	free(iov);
+}
+
+void disk_writev( int blocknum, const char **data, int count )
+{
+	struct iovec *iov;
+	struct stats_timer t;
+
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+	stats_begin(&t);
+
+	if(diskmap) {
+		for(int i=0;i<count;i++) disk_write_raw(blocknum+i,data[i]);
+		stats_end(STATS_DISK_WRITEV,&t,(long)count*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	cache_update_run(blocknum,data,count);
+
+	iov = malloc(count*sizeof(struct iovec));
+	if(!iov) {
+		for(int i=0;i<count;i++) disk_write_raw(blocknum+i,data[i]);
+		stats_end(STATS_DISK_WRITEV,&t,(long)count*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	for(int i=0;i<count;i++) {
+		sanity_check(blocknum+i,data[i]);
+		iov[i].iov_base = (char *)data[i];
+		iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+
+	disk_transfer_run(blocknum,iov,count,1);
+	cache_clean_run(blocknum,iov,count);
+	free(iov);
+	stats_end(STATS_DISK_WRITEV,&t,(long)count*DISK_BLOCK_SIZE);
+}
+
+/*
+Asynchronous requests are cut into operations of at most AIO_OP_BLOCKS
+blocks, and up to aio_depth operations are kept in flight at once.
+Where the kernel offers io_uring, operations go onto its submission
+ring as READV/WRITEV entries, and whichever thread is waiting picks the
+completions off the completion ring. Otherwise AIO_THREADS worker
+threads take them from a queue and do the preadv/pwritev themselves.
+A queue depth of 0, or a mapped image, runs each request to completion
+inside disk_submit.
+
+Requests see the cache just as disk_readv/disk_writev do. When a read
+is submitted, whatever is resident is copied out and only the gaps go
+to the image. A write updates the resident copies in place.
+
+A request holds one count in pending for each operation still out, plus
+one while disk_submit is still cutting it up. The done callback is
+called without aio_lock held once pending reaches zero, and only then
+is complete set.
+*/
+
+struct aio_op {
+	struct disk_request *req;
+	int blocknum;
+	int count;
+	int write;
+	struct aio_op *next;
+	struct iovec iov[];
+};
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static int aio_depth = AIO_DEPTH_DEFAULT;
+static int aio_inflight = 0;
+static int aio_peak = 0;
+static int aio_nrequests = 0;
+static int aio_nops = 0;
+
+static pthread_cond_t aio_work = PTHREAD_COND_INITIALIZER;
+static pthread_t aio_threads[AIO_THREADS];
+static int aio_nthreads = 0;
+static int aio_stopping = 0;
+static struct aio_op *aio_queue = 0;
+static struct aio_op *aio_queue_tail = 0;
+
+#ifdef DISK_URING
+static int ring_fd = -1;
+static int ring_waiting = 0;
+static unsigned ring_entries = 0;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring = 0;
+static void *cq_ring = 0;
+static size_t sq_ring_size, cq_ring_size;
+
+static int ring_setup( unsigned entries )
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p,0,sizeof(p));
+	fd = syscall(__NR_io_uring_setup,entries,&p);
+	if(fd<0) return 0;
+
+	sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_ring_size>sq_ring_size) sq_ring_size = cq_ring_size;
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = mmap(0,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if(sq_ring==MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(0,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	}
+	sqes = mmap(0,p.sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(cq_ring==MAP_FAILED || sqes==MAP_FAILED) {
+		if(cq_ring!=MAP_FAILED && cq_ring!=sq_ring) munmap(cq_ring,cq_ring_size);
+		if(sqes!=MAP_FAILED) munmap(sqes,p.sq_entries*sizeof(struct io_uring_sqe));
+		munmap(sq_ring,sq_ring_size);
+		close(fd);
+		return 0;
+	}
+
+	sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+	sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+	cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+
+	ring_entries = p.sq_entries;
+	ring_fd = fd;
+	return 1;
+}
+
+static void ring_teardown()
+{
+	if(ring_fd<0) return;
+	munmap(sqes,ring_entries*sizeof(struct io_uring_sqe));
+	if(cq_ring!=sq_ring) munmap(cq_ring,cq_ring_size);
+	munmap(sq_ring,sq_ring_size);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+//hand the kernel every entry it has not taken yet, optionally waiting for a completion
+static void ring_enter( int wait )
+{
+	unsigned submit = __atomic_load_n(sq_tail,__ATOMIC_ACQUIRE) - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE);
+	int r;
+
+	if(!submit && !wait) return;
+
+	do {
+		r = syscall(__NR_io_uring_enter,ring_fd,submit,wait,wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+	} while(r<0 && errno==EINTR);
+}
+
+static void ring_push( struct aio_op *op )
+{
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = diskfd;
+	sqe->off = (uint64_t)op->blocknum*DISK_BLOCK_SIZE;
+	sqe->addr = (uintptr_t)op->iov;
+	sqe->len = op->count;
+	sqe->user_data = (uintptr_t)op;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+}
+
+static void aio_complete( struct aio_op *op, ssize_t result );
+
+//complete whatever the kernel has finished; aio_lock is held but may be dropped in between
+static int ring_reap()
+{
+	int reaped = 0;
+
+	while(1) {
+		unsigned head = *cq_head;
+		if(head==__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) break;
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		struct aio_op *op = (struct aio_op *)(uintptr_t)cqe->user_data;
+		int result = cqe->res;
+		__atomic_store_n(cq_head,head+1,__ATOMIC_RELEASE);
+		aio_complete(op,result);
+		reaped++;
+	}
+
+	return reaped;
+}
+#endif
+
+static ssize_t aio_transfer( struct aio_op *op )
+{
+	off_t offset = (off_t)op->blocknum*DISK_BLOCK_SIZE;
+
+	if(op->write) return pwritev(diskfd,op->iov,op->count,offset);
+	return preadv(diskfd,op->iov,op->count,offset);
+}
+
+//run the callback of a request whose operations are all done; called with aio_lock held
+static void aio_finish( struct disk_request *req )
+{
+	if(req->done) {
+		pthread_mutex_unlock(&aio_lock);
+		req->done(req);
+		pthread_mutex_lock(&aio_lock);
+	}
+	req->complete = 1;
+	pthread_cond_broadcast(&aio_cond);
+}
+
+static void aio_complete( struct aio_op *op, ssize_t result )
+{
+	struct disk_request *req = op->req;
+
+	if(result==(ssize_t)op->count*DISK_BLOCK_SIZE) {
+		count_io(op->write,op->count);
+	} else {
+		//redo a short or failed transfer the ordinary way, which gives up on a real error
+		disk_transfer_run(op->blocknum,op->iov,op->count,op->write);
+	}
+	if(op->write) cache_clean_run(op->blocknum,op->iov,op->count);
+
+	aio_inflight--;
+	free(op);
+	pthread_cond_broadcast(&aio_cond);
+	if(--req->pending==0) aio_finish(req);
+}
+
+static void * aio_worker( void *arg )
+{
+	struct aio_op *op;
+	ssize_t result;
+
+	pthread_mutex_lock(&aio_lock);
+	while(1) {
+		while(!aio_queue && !aio_stopping) pthread_cond_wait(&aio_work,&aio_lock);
+		if(!aio_queue) break;
+		op = aio_queue;
+		aio_queue = op->next;
+		if(!aio_queue) aio_queue_tail = 0;
+		pthread_mutex_unlock(&aio_lock);
+
+		result = aio_transfer(op);
+
+		pthread_mutex_lock(&aio_lock);
+		aio_complete(op,result);
+	}
+	pthread_mutex_unlock(&aio_lock);
+	return 0;
+}
+
+/*
+Wait until some operation completes. With io_uring one waiting thread
+sleeps in the kernel and the others wait for it to hand over. Called
+with aio_lock held, and only while an operation is in flight.
+*/
+static void aio_progress()
+{
+#ifdef DISK_URING
+	if(ring_fd>=0) {
+		if(ring_reap()) return;
+		if(ring_waiting) {
+			pthread_cond_wait(&aio_cond,&aio_lock);
+			return;
+		}
+		ring_waiting = 1;
+		pthread_mutex_unlock(&aio_lock);
+		ring_enter(1);
+		pthread_mutex_lock(&aio_lock);
+		ring_waiting = 0;
+		ring_reap();
+		pthread_cond_broadcast(&aio_cond);
+		return;
+	}
+#endif
+	pthread_cond_wait(&aio_cond,&aio_lock);
+}
+
+//start an operation, waiting for room in the queue first; called with aio_lock held
+static void aio_start( struct aio_op *op )
+{
+	while(aio_inflight>=aio_depth) aio_progress();
+	aio_inflight++;
+	aio_nops++;
+	if(aio_inflight>aio_peak) aio_peak = aio_inflight;
+
+#ifdef DISK_URING
+	if(ring_fd>=0) {
+		ring_push(op);
+		return;
+	}
+#endif
+
+	if(!aio_nthreads && !aio_stopping) {
+		for(int t=0;t<AIO_THREADS;t++) {
+			if(pthread_create(&aio_threads[aio_nthreads],0,aio_worker,0)) break;
+			aio_nthreads++;
+		}
+	}
+	if(!aio_nthreads) {
+		//no threads to be had; do it here
+		ssize_t result = aio_transfer(op);
+		aio_complete(op,result);
+		return;
+	}
+
+	op->next = 0;
+	if(aio_queue_tail) {
+		aio_queue_tail->next = op;
+	} else {
+		aio_queue = op;
+	}
+	aio_queue_tail = op;
+	pthread_cond_signal(&aio_work);
+}
+
+static struct aio_op * aio_op_new( struct disk_request *req, int first, int count )
+{
+	struct aio_op *op = malloc(sizeof(struct aio_op) + count*sizeof(struct iovec));
+
+	if(!op) return 0;
+	op->req = req;
+	op->blocknum = req->blocknum+first;
+	op->count = count;
+	op->write = req->write;
+	op->next = 0;
+	for(int i=0;i<count;i++) {
+		op->iov[i].iov_base = req->data[first+i];
+		op->iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+	return op;
+}
+
+//queue the blocks [first, first+count) of req as operations; called with aio_lock held
+static void aio_start_run( struct disk_request *req, int first, int count )
+{
+	while(count>0) {
+		int n = count<AIO_OP_BLOCKS ? count : AIO_OP_BLOCKS;
+		struct aio_op *op = aio_op_new(req,first,n);
+
+		if(op) {
+			req->pending++;
+			aio_start(op);
+		} else {
+			//no memory to describe it; move the blocks one at a time
+			for(int i=first;i<first+n;i++) {
+				if(req->write) {
+					disk_write_raw(req->blocknum+i,req->data[i]);
+				} else {
+					disk_read_raw(req->blocknum+i,req->data[i]);
+				}
+			}
+		}
+		first += n;
+		count -= n;
+	}
+}
+
+void disk_submit( struct disk_request *reqs, int n )
+{
+	for(int r=0;r<n;r++) {
+		struct disk_request *req = &reqs[r];
+		char *cached = 0;
+
+		req->pending = 1;
+		req->complete = 0;
+		if(req->count<=0) {
+			pthread_mutex_lock(&aio_lock);
+			aio_nrequests++;
+			if(--req->pending==0) aio_finish(req);
+			pthread_mutex_unlock(&aio_lock);
+			continue;
+		}
+		sanity_check(req->blocknum,req->data);
+		sanity_check(req->blocknum+req->count-1,req->data);
+		for(int i=0;i<req->count;i++) sanity_check(req->blocknum+i,req->data[i]);
+
+		if(diskmap || !aio_depth) {
+			if(req->write) {
+				disk_writev(req->blocknum,(const char **)req->data,req->count);
+			} else {
+				disk_readv(req->blocknum,req->data,req->count);
+			}
+		} else if(req->write) {
+			cache_update_run(req->blocknum,(const char **)req->data,req->count);
+		} else {
+			cached = calloc(req->count,1);
+			if(cached) cache_copy_run(req->blocknum,req->data,req->count,cached);
+		}
+
+		pthread_mutex_lock(&aio_lock);
+		aio_nrequests++;
+		if(!diskmap && aio_depth) {
+			int first, len;
+			for(first=0;first<req->count;first+=len) {
+				if(cached && cached[first]) {
+					len = 1;
+					continue;
+				}
+				for(len=1;first+len<req->count && !(cached && cached[first+len]);len++);
+				aio_start_run(req,first,len);
+			}
+		}
+		if(--req->pending==0) aio_finish(req);
+		pthread_mutex_unlock(&aio_lock);
+
+		free(cached);
+	}
+
+#ifdef DISK_URING
+	pthread_mutex_lock(&aio_lock);
+	if(ring_fd>=0) ring_enter(0);
+	pthread_mutex_unlock(&aio_lock);
+#endif
+}
+
+int disk_poll( struct disk_request *req )
+{
+	int complete;
+
+	pthread_mutex_lock(&aio_lock);
+#ifdef DISK_URING
+	if(ring_fd>=0 && !req->complete) ring_reap();
+#endif
+	complete = req->complete;
+	pthread_mutex_unlock(&aio_lock);
+
+	return complete;
+}
+
+void disk_wait( struct disk_request *reqs, int n )
+{
+	struct stats_timer t;
+	long bytes = 0;
+
+	stats_begin(&t);
+	pthread_mutex_lock(&aio_lock);
+	for(int r=0;r<n;r++) {
+		while(!reqs[r].complete) {
+			//with nothing pending, another thread is just running the callback
+			if(reqs[r].pending) {
+				aio_progress();
+			} else {
+				pthread_cond_wait(&aio_cond,&aio_lock);
+			}
+		}
+		bytes += (long)reqs[r].count*DISK_BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&aio_lock);
+	stats_end(STATS_DISK_WAIT,&t,bytes);
+}
+
+void disk_set_queue_depth( int depth )
+{
+	if(depth<0) depth = 0;
+	if(depth>AIO_DEPTH_MAX) depth = AIO_DEPTH_MAX;
+
+	pthread_mutex_lock(&aio_lock);
+#ifdef DISK_URING
+	if(ring_fd>=0 && depth>(int)ring_entries) depth = ring_entries;
+#endif
+	aio_depth = depth;
+	pthread_mutex_unlock(&aio_lock);
+}
+
+static void aio_init()
+{
+	aio_inflight = aio_peak = 0;
+	aio_nrequests = aio_nops = 0;
+	aio_stopping = 0;
+#ifdef DISK_URING
+	if(!diskmap && ring_fd<0) ring_setup(AIO_DEPTH_MAX);
+	if(ring_fd>=0 && aio_depth>(int)ring_entries) aio_depth = ring_entries;
+#endif
+}
+
+static void aio_shutdown()
+{
+	pthread_mutex_lock(&aio_lock);
+	while(aio_inflight) aio_progress();
+	aio_stopping = 1;
+	pthread_cond_broadcast(&aio_work);
+	pthread_mutex_unlock(&aio_lock);
+
+	for(int t=0;t<aio_nthreads;t++) pthread_join(aio_threads[t],0);
+	aio_nthreads = 0;
+
+#ifdef DISK_URING
+	ring_teardown();
+#endif
+}
+
+static const char * aio_engine()
+{
+	if(diskmap || !aio_depth) return "synchronous";
+#ifdef DISK_URING
+	if(ring_fd>=0) return "io_uring";
+#endif
+	return "thread pool";
+}
+
+char * disk_borrow( int blocknum )
+{
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	count_io(0,1);
+
+	return diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+void disk_release( int blocknum, int dirty )
+{
+	if(!diskmap) return;
+
+	sanity_check(blocknum,diskmap);
+	if(dirty) count_io(1,1);
+}
+
+void disk_flush()
+{
+	struct stats_timer t;
+
+	if(diskfd<0) return;
+	stats_begin(&t);
+
+	if(diskmap) {
+		msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+		stats_end(STATS_DISK_FLUSH,&t,0);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<cache_size;i++) {
+		if(!cache[i].busy) cache_writeback(&cache[i]);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	stats_end(STATS_DISK_FLUSH,&t,0);
+}
+
+void disk_cache_resize( int nslots )
+{
+	if(diskfd<0 || diskmap) return;
+
+	pthread_mutex_lock(&cache_lock);
+	//fetches and prefetches in flight still write into the old slots
+	for(;;) {
+		int busy = cache_pending;
+		for(int i=0;!busy && i<cache_size;i++) busy = cache[i].busy;
+		if(!busy) break;
+		pthread_cond_wait(&cache_cond,&cache_lock);
+	}
+	for(int i=0;i<cache_size;i++) cache_writeback(&cache[i]);
+	cache_free();
+	if(!cache_alloc(nslots)) {
+		printf("WARNING: couldn't allocate a %d block cache, caching disabled\n",nslots);
 	}
+	pthread_mutex_unlock(&cache_lock);
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	if(diskfd>=0) {
+		disk_flush();
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		printf("%d cache hits\n",nhits);
+		printf("%d cache misses\n",nmisses);
+		if(aio_nrequests) {
+			printf("%d async requests, %d operations, at most %d in flight (%s)\n",
+				aio_nrequests,aio_nops,aio_peak,aio_engine());
+		}
+		aio_shutdown();
+		if(diskmap) {
+			munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+			diskmap = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
+		cache_free();
 	}
 }
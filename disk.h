@@ -2,12 +2,51 @@
 #define DISK_H
 
 #define DISK_BLOCK_SIZE 4096
+#define DISK_CACHE_DEFAULT 64
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_mapped( const char *filename, int nblocks );
 int  disk_size();
+int  disk_read_count();
+int  disk_write_count();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( int blocknum, char **data, int count );
+void disk_writev( int blocknum, const char **data, int count );
+int  disk_reserve( int blocknum, int count );
+void disk_prefetch( int blocknum, int count );
+char *disk_borrow( int blocknum );
+void disk_release( int blocknum, int dirty );
+void disk_cache_resize( int nslots );
+void disk_flush();
 void disk_close();
 
+/*
+Asynchronous requests. Each one moves count consecutive blocks starting
+at blocknum to or from the buffers in data (which are only read from for
+a write). disk_submit queues a batch and returns without waiting, and
+completion is found out with disk_poll or disk_wait, or through the
+done callback, which is called once the data has been transferred and
+before disk_poll or disk_wait report the request finished. The request
+and its buffers belong to the disk layer until then. The remaining
+fields are private.
+*/
+struct disk_request {
+	int blocknum;
+	int count;
+	char **data;
+	int write;
+	void (*done)( struct disk_request *req );
+	void *arg;
+
+	int pending;
+	int complete;
+};
+
+void disk_submit( struct disk_request *reqs, int n );
+int  disk_poll( struct disk_request *req );
+void disk_wait( struct disk_request *reqs, int n );
+void disk_set_queue_depth( int depth );
+
 
 #endif
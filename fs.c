@@ -1,5 +1,7 @@
 #include "fs.h"
 #include "disk.h"
+#include "journal.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,181 +10,1346 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <limits.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define INODES_PER_BLOCK   64
+#define INODES_PER_BLOCK_V1 128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define SCAN_BATCH         32
+#define READ_BATCH         64
+#define MAP_BLOCKS         (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+#define DOUBLE_BLOCKS      (POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define TRIPLE_BLOCKS      (POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define INDEX_SLOTS        4
+#define JOURNAL_GROUP      256
+#define JOURNAL_MIN_DISK   64
+#define JOURNAL_MAX_BLOCKS 1024
+#define FS_MAX_OPEN        64
+#define RA_QUEUE           64
+#define RA_MIN_WINDOW      4
+#define RA_DEFAULT_WINDOW  32
+#define WB_MAX_BLOCKS      256
+#define WB_DEFAULT_BLOCKS  64
+#define INODE_LOCKS        256
+#define INODE_BLOCK_LOCKS  64
 
 int inode_blocks;
-int *allocate_bitmap;
+int inodes_per_block;
+int inode_table_blocks;
+int file_block_limit;
+uint64_t *allocate_bitmap;
+int bitmap_words;
+int free_blocks;
+unsigned char *bitmap_dirty = 0;
+int journal_ops = 0;
+int next_fit;
+int meta_fit;
+int scan_threads = 0;
 int mounted = 0;
 
+#define CACHE_LINE 64
+#define BITS_PER_WORD 64
+#define WORDS_PER_BLOCK (DISK_BLOCK_SIZE / 8)
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int nbitmapblocks;
+	int clean;
+	int inodesize;
+	int njournalblocks;
+	int nlazyblocks;
+	int rootdir;	//inode of the root directory, 0 until one is made
 };
 
+/*
+Past the direct and indirect pointers, a file continues through a
+double-indirect tree (an index block of index blocks) and then a
+triple-indirect one. Images formatted before these existed have
+inodesize 0 in the superblock and pack 32-byte struct fs_inode_v1
+inodes, 128 to a block; they are converted to and from struct fs_inode
+as the inode table is loaded and synced, and their files stay limited
+to MAP_BLOCKS blocks since there is nowhere to keep the extra roots.
+
+Block 0 is the superblock, so a zero pointer at any level is a hole:
+files are sparse, a write only allocates the blocks it touches, and a
+hole reads back as zeroes without going to the disk.
+*/
 struct fs_inode {
 	int isvalid;
 	int size;
 	int direct[POINTERS_PER_INODE];
 	int indirect;
+	int double_indirect;
+	int triple_indirect;
+	int unused[6];
+};
+
+struct fs_inode_v1 {
+	int isvalid;
+	int size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
 };
 
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_inode_v1 inode_v1[INODES_PER_BLOCK_V1];
 	int pointers[POINTERS_PER_BLOCK];
+	uint64_t words[WORDS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
+/*
+While mounted, the whole inode region is kept in memory. inode_table
+holds the inode blocks back to back, so inode n lives at
+inode_table[n/INODES_PER_BLOCK].inode[n%INODES_PER_BLOCK], and
+inode_dirty flags the on-disk inode blocks that have to be written back
+by inode_sync before the operation that changed them returns; their
+indices are also queued on dirty_list so the sync never has to look
+at clean blocks.
+
+fs_format does not touch the inode region. The last nlazyblocks inode
+blocks in the superblock have never been written and hold whatever was
+on the disk before, so they are taken to be empty instead of being read.
+Since inodes are handed out lowest first, they are written in order:
+when an inode block at or past that watermark is first synced, the
+empty blocks before it go out with it and the watermark moves past it
+in the same journal transaction.
+
+Free inodes are indexed by inode_free_map, one bit per inode with a
+set bit meaning free. fs_create takes the lowest free inode at or
+after inode_hint, and fs_delete gives its inode back and moves the
+hint down.
+*/
+
+struct fs_superblock superblock;
+union fs_block *inode_table = 0;
+unsigned char *inode_dirty = 0;
+int *dirty_list = 0;
+int ndirty = 0;
+uint64_t *inode_free_map = 0;
+int inode_words = 0;
+int inode_hint = 0;
+
+/*
+The fs calls may be made from several threads at once, apart from
+fs_format, fs_mount, fs_unmount and fs_debug, which expect to have the
+filesystem to themselves.
+
+Each inode has a reader-writer lock (striped: inode n uses
+inode_locks[n % INODE_LOCKS]). fs_pread and fs_getsize hold it shared,
+fs_pwrite, fs_delete and write-behind flushes hold it exclusively, so
+independent files are read and written in parallel and any number of
+readers share a file. Readers still update the file's index cache and
+readahead state, which sit under the open file's own mutex; that is
+only held while blocks are looked up, never across the data transfer.
+
+The resident inodes are written out a whole block at a time, so changes
+to them are made under a mutex striped over the inode blocks, and
+inode_sync copies each block image under the same mutex. meta_lock
+covers the dirty inode list, the free-inode index and the journal, and
+files_lock the open file table. The allocation bitmap needs no lock at
+all (see below).
+
+Locks are taken in the order files_lock, inode lock, open file mutex,
+meta_lock, inode block mutex.
+*/
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_mutex_t iblock_locks[INODE_BLOCK_LOCKS];
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void inode_rdlock( int inumber )
+{
+	pthread_rwlock_rdlock(&inode_locks[inumber % INODE_LOCKS]);
+}
 
-void update_Bmap(){
+static void inode_wrlock( int inumber )
+{
+	pthread_rwlock_wrlock(&inode_locks[inumber % INODE_LOCKS]);
+}
+
+static void inode_unlock( int inumber )
+{
+	pthread_rwlock_unlock(&inode_locks[inumber % INODE_LOCKS]);
+}
+
+//guard the on-disk inode block holding inumber while the inode changes
+static void iblock_lock( int inumber )
+{
+	pthread_mutex_lock(&iblock_locks[inumber / inodes_per_block % INODE_BLOCK_LOCKS]);
+}
+
+static void iblock_unlock( int inumber )
+{
+	pthread_mutex_unlock(&iblock_locks[inumber / inodes_per_block % INODE_BLOCK_LOCKS]);
+}
+
+
+static void journal_reserve();
+
+/*
+Indirect and index blocks are metadata: with a journal they are logged
+rather than written in place, and the newest logged copy wins on read.
+*/
+static void meta_read( int blocknum, char *data )
+{
+	pthread_mutex_lock(&meta_lock);
+	int logged = journal_lookup(blocknum, data);
+	pthread_mutex_unlock(&meta_lock);
+	if(!logged) disk_read(blocknum, data);
+}
+
+static void meta_write( int blocknum, const char *data )
+{
+	pthread_mutex_lock(&meta_lock);
+	journal_log(blocknum, data);
+	journal_reserve();
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/*
+The allocation bitmap packs one bit per block into 64-bit words. Bits
+past the end of the disk are set at mount so they are never handed
+out. free_blocks is kept current by bitmap_set/bitmap_clear, and
+allocate_free_block resumes scanning at next_fit, the word where the
+last allocation succeeded, so filling a file does not rescan the
+front of the disk each time.
+
+Bits are flipped with atomic read-modify-write operations, and a block
+belongs to whoever's bitmap_set found its bit clear, so allocators
+running in parallel never hand out the same block; one that loses a
+race just moves on to the next free bit. free_blocks and the two fit
+hints are updated atomically as well.
+*/
+static int bitmap_test( int n )
+{
+	return (__atomic_load_n(&allocate_bitmap[n / BITS_PER_WORD], __ATOMIC_RELAXED) >> (n % BITS_PER_WORD)) & 1;
+}
+
+//claim block n; returns 0 if it was already taken
+static int bitmap_set( int n )
+{
+	uint64_t bit = (uint64_t)1 << (n % BITS_PER_WORD);
+	if(n < 0 || n >= superblock.nblocks) return 0;
+	if(__atomic_fetch_or(&allocate_bitmap[n / BITS_PER_WORD], bit, __ATOMIC_ACQ_REL) & bit) return 0;
+	if(bitmap_dirty) __atomic_store_n(&bitmap_dirty[n / (DISK_BLOCK_SIZE * 8)], 1, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&free_blocks, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void bitmap_clear( int n )
+{
+	uint64_t bit = (uint64_t)1 << (n % BITS_PER_WORD);
+	if(n < 0 || n >= superblock.nblocks) return;
+	if(!(__atomic_fetch_and(&allocate_bitmap[n / BITS_PER_WORD], ~bit, __ATOMIC_ACQ_REL) & bit)) return;
+	if(bitmap_dirty) __atomic_store_n(&bitmap_dirty[n / (DISK_BLOCK_SIZE * 8)], 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&free_blocks, 1, __ATOMIC_RELAXED);
+}
+
+static int free_count()
+{
+	return __atomic_load_n(&free_blocks, __ATOMIC_RELAXED);
+}
+
+//recompute free_blocks from scratch
+static void bitmap_recount()
+{
+	free_blocks = 0;
+	for(int w = 0; w < bitmap_words; w++) {
+		free_blocks += BITS_PER_WORD - __builtin_popcountll(allocate_bitmap[w]);
+	}
+}
+
+static int bitmap_init( int nblocks )
+{
+	free(allocate_bitmap);
+	free(bitmap_dirty);
+	bitmap_words = (nblocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	allocate_bitmap = calloc(bitmap_words, sizeof(uint64_t));
+	bitmap_dirty = superblock.nbitmapblocks ? calloc(superblock.nbitmapblocks, 1) : 0;
+	if(!allocate_bitmap) return 0;
+
+	//mark the tail of the last word as used
+	if(nblocks % BITS_PER_WORD) {
+		allocate_bitmap[bitmap_words - 1] = ~(uint64_t)0 << (nblocks % BITS_PER_WORD);
+	}
+	free_blocks = nblocks;
+	next_fit = 0;
+	meta_fit = bitmap_words - 1;
+	return 1;
+}
+
+/*
+Filesystems formatted with a bitmap region keep a copy of the bitmap
+in the nbitmapblocks blocks that follow the inode blocks. It is only
+trusted when the superblock says the last unmount was clean; fs_mount
+clears the flag on disk and fs_unmount sets it again after saving the
+bitmap. Older images have no bitmap region and are always scanned.
+*/
+static int bitmap_start()
+{
+	return inode_blocks + 1;
+}
+
+static void bitmap_load()
+{
 	union fs_block block;
-	union fs_block indirect_block;
-
-	for (int i = 0; i < disk_size(); i++) {
-		//read
-		disk_read(i, block.data);
-		//check superblock magic number
-		if (!i) {
-			allocate_bitmap[0] = (block.super.magic == FS_MAGIC) ? 1 : 0;
+
+	for(int i = 0; i < superblock.nbitmapblocks; i++) {
+		disk_read(bitmap_start() + i, block.data);
+		for(int k = 0; k < WORDS_PER_BLOCK; k++) {
+			int w = i * WORDS_PER_BLOCK + k;
+			if(w >= bitmap_words) break;
+			allocate_bitmap[w] = block.words[k];
+		}
+	}
+
+	if(superblock.nblocks % BITS_PER_WORD) {
+		allocate_bitmap[bitmap_words - 1] |= ~(uint64_t)0 << (superblock.nblocks % BITS_PER_WORD);
+	}
+	bitmap_recount();
+}
+
+//the on-disk image of bitmap block i
+static void bitmap_block_image( int i, union fs_block *block )
+{
+	memset(block->data, 0, sizeof(block->data));
+	for(int k = 0; k < WORDS_PER_BLOCK; k++) {
+		int w = i * WORDS_PER_BLOCK + k;
+		if(w >= bitmap_words) break;
+		block->words[k] = __atomic_load_n(&allocate_bitmap[w], __ATOMIC_ACQUIRE);
+	}
+}
+
+static void bitmap_save()
+{
+	union fs_block block;
+
+	for(int i = 0; i < superblock.nbitmapblocks; i++) {
+		bitmap_block_image(i, &block);
+		disk_write(bitmap_start() + i, block.data);
+		bitmap_dirty[i] = 0;
+	}
+}
+
+static void superblock_save()
+{
+	union fs_block block;
+
+	memset(block.data, 0, sizeof(block.data));
+	block.super = superblock;
+	disk_write(0, block.data);
+}
+
+/*
+Read or write the blocks listed in blocks[] to or from bufs[], issuing
+a single disk request for each run of adjacent block numbers. All the
+requests are submitted before any is waited on, so the runs of a
+fragmented range are in flight together.
+*/
+static void transfer_runs( const int *blocks, char **bufs, int n, int write )
+{
+	struct disk_request stack[READ_BATCH];
+	struct disk_request *reqs = (n <= READ_BATCH) ? stack : malloc(n * sizeof(struct disk_request));
+	int nreqs = 0;
+	int start = 0;
+
+	while(start < n) {
+		int end = start + 1;
+		while(end < n && blocks[end] == blocks[end-1] + 1) end++;
+		if(!reqs) {
+			if(write) disk_writev(blocks[start], (const char **)bufs + start, end - start);
+			else disk_readv(blocks[start], bufs + start, end - start);
+		} else {
+			memset(&reqs[nreqs], 0, sizeof(reqs[nreqs]));
+			reqs[nreqs].blocknum = blocks[start];
+			reqs[nreqs].count = end - start;
+			reqs[nreqs].data = bufs + start;
+			reqs[nreqs].write = write;
+			nreqs++;
+		}
+		start = end;
+	}
+
+	if(reqs) {
+		disk_submit(reqs, nreqs);
+		disk_wait(reqs, nreqs);
+	}
+	if(reqs != stack) free(reqs);
+}
+
+static void read_runs( const int *blocks, char **bufs, int n )
+{
+	transfer_runs(blocks, bufs, n, 0);
+}
+
+static void write_runs( const int *blocks, const char **bufs, int n )
+{
+	transfer_runs(blocks, (char **)bufs, n, 1);
+}
+
+struct fs_inode * inode_get( int inumber )
+{
+	if(inumber < 0 || inumber >= superblock.ninodes) return 0;
+	return &inode_table[inumber / INODES_PER_BLOCK].inode[inumber % INODES_PER_BLOCK];
+}
+
+void inode_mark_dirty( int inumber )
+{
+	int b = inumber / inodes_per_block;
+	pthread_mutex_lock(&meta_lock);
+	if (!inode_dirty[b]) {
+		inode_dirty[b] = 1;
+		dirty_list[ndirty++] = b;
+		journal_reserve();
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+static int superblock_inodes_per_block( const struct fs_superblock *sb )
+{
+	return sb->inodesize ? DISK_BLOCK_SIZE / sb->inodesize : INODES_PER_BLOCK_V1;
+}
+
+//unpack inode j of a raw inode block laid out as per the superblock
+static void inode_unpack( const struct fs_superblock *sb, const union fs_block *raw, int j, struct fs_inode *inode )
+{
+	if (sb->inodesize) {
+		*inode = raw->inode[j];
+		return;
+	}
+	memset(inode, 0, sizeof(*inode));
+	inode->isvalid = raw->inode_v1[j].isvalid;
+	inode->size = raw->inode_v1[j].size;
+	memcpy(inode->direct, raw->inode_v1[j].direct, sizeof(inode->direct));
+	inode->indirect = raw->inode_v1[j].indirect;
+}
+
+//the on-disk image of inode block b, built in buf if the layouts differ
+static const char * inode_block_image( int b, union fs_block *buf )
+{
+	if (superblock.inodesize) return inode_table[b].data;
+
+	memset(buf->data, 0, sizeof(buf->data));
+	for (int j = 0; j < INODES_PER_BLOCK_V1; j++) {
+		struct fs_inode *inode = inode_get(b * INODES_PER_BLOCK_V1 + j);
+		if (!inode) break;
+		buf->inode_v1[j].isvalid = inode->isvalid;
+		buf->inode_v1[j].size = inode->size;
+		memcpy(buf->inode_v1[j].direct, inode->direct, sizeof(inode->direct));
+		buf->inode_v1[j].indirect = inode->indirect;
+	}
+	return buf->data;
+}
+
+//copy the image of inode block b while nothing is changing it
+static void inode_block_copy( int b, union fs_block *out )
+{
+	union fs_block buf;
+
+	pthread_mutex_lock(&iblock_locks[b % INODE_BLOCK_LOCKS]);
+	memcpy(out->data, inode_block_image(b, &buf), sizeof(out->data));
+	pthread_mutex_unlock(&iblock_locks[b % INODE_BLOCK_LOCKS]);
+}
+
+/*
+Queue the uninitialized inode blocks below the highest dirty one, and
+move the watermark past it. Returns 1 if the superblock has to be
+written out along with the inode blocks. Called with meta_lock held.
+*/
+static int inode_lazy_advance()
+{
+	int start = superblock.ninodeblocks - superblock.nlazyblocks;
+	int last = -1;
+
+	for (int i = 0; i < ndirty; i++) {
+		if (dirty_list[i] > last) last = dirty_list[i];
+	}
+	if (last < start) return 0;
+
+	for (int b = start; b < last; b++) {
+		if (inode_dirty[b]) continue;
+		inode_dirty[b] = 1;
+		dirty_list[ndirty++] = b;
+	}
+	superblock.nlazyblocks = superblock.ninodeblocks - last - 1;
+	return 1;
+}
+
+/*
+With a journal, inode_sync does not write anything itself. Modified
+inode and bitmap blocks stay marked until fs_commit logs their current
+contents along with the index blocks already handed to meta_write, and
+the lot goes to the journal as one transaction. That happens every
+JOURNAL_GROUP operations, on fs_sync and at unmount, so a burst of
+small operations costs one sequential journal write instead of a
+scattered in-place write per block touched. Called with meta_lock held.
+*/
+static void fs_commit()
+{
+	union fs_block buf;
+
+	if (inode_lazy_advance()) {
+		memset(buf.data, 0, sizeof(buf.data));
+		buf.super = superblock;
+		journal_log(0, buf.data);
+	}
+	while (ndirty > 0) {
+		int b = dirty_list[--ndirty];
+		inode_dirty[b] = 0;
+		inode_block_copy(b, &buf);
+		journal_log(b + 1, buf.data);
+	}
+	for (int i = 0; i < superblock.nbitmapblocks; i++) {
+		//clear the flag first, so a bit flipped while the image is built marks it again
+		if (!__atomic_exchange_n(&bitmap_dirty[i], 0, __ATOMIC_ACQ_REL)) continue;
+		bitmap_block_image(i, &buf);
+		journal_log(bitmap_start() + i, buf.data);
+	}
+	journal_commit();
+	journal_ops = 0;
+}
+
+/*
+journal_log never commits by itself, so the log has to keep room for
+what fs_commit adds to the running transaction: every dirty inode
+block, at most every bitmap block, and the superblock. Called with
+meta_lock held after the running transaction or the dirty list has
+grown by a block, which the margin of two leaves room for, and commits
+early if the next one might not fit. That commit holds the inode and
+bitmap images along with the index blocks, so it is consistent even in
+the middle of an operation.
+*/
+static void journal_reserve()
+{
+	if (journal_active() && journal_room() < ndirty + superblock.nbitmapblocks + 2) fs_commit();
+}
+
+//write every modified inode block back through the block cache
+void inode_sync()
+{
+	union fs_block buf;
+
+	pthread_mutex_lock(&meta_lock);
+	if (journal_active()) {
+		if (++journal_ops >= JOURNAL_GROUP) fs_commit();
+		pthread_mutex_unlock(&meta_lock);
+		return;
+	}
+
+	int moved = inode_lazy_advance();
+	while (ndirty > 0) {
+		int b = dirty_list[--ndirty];
+		inode_dirty[b] = 0;
+		inode_block_copy(b, &buf);
+		disk_write(b + 1, buf.data);
+	}
+	if (moved) superblock_save();
+	pthread_mutex_unlock(&meta_lock);
+}
+
+static void inode_free_set( int inumber, int isfree )
+{
+	uint64_t bit = (uint64_t)1 << (inumber % BITS_PER_WORD);
+	if (isfree) {
+		inode_free_map[inumber / BITS_PER_WORD] |= bit;
+		if (inumber / BITS_PER_WORD < inode_hint) inode_hint = inumber / BITS_PER_WORD;
+	} else {
+		inode_free_map[inumber / BITS_PER_WORD] &= ~bit;
+	}
+}
+
+//find and claim the lowest free inode number, or return 0
+static int inode_alloc()
+{
+	for (int w = inode_hint; w < inode_words; w++) {
+		if (!inode_free_map[w]) continue;
+		int inumber = w * BITS_PER_WORD + __builtin_ctzll(inode_free_map[w]);
+		inode_hint = w;
+		inode_free_set(inumber, 0);
+		return inumber;
+	}
+	inode_hint = inode_words;
+	return 0;
+}
+
+//read the inode region into memory, a batch of blocks per request
+int inode_table_load()
+{
+	char *bufs[SCAN_BATCH];
+
+	free(inode_table);
+	free(inode_dirty);
+	free(dirty_list);
+	free(inode_free_map);
+	inode_words = (superblock.ninodes + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	inode_table_blocks = (superblock.ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	inode_table = aligned_alloc(CACHE_LINE, inode_table_blocks * sizeof(union fs_block));
+	inode_dirty = calloc(inode_blocks, 1);
+	dirty_list = malloc(inode_blocks * sizeof(int));
+	inode_free_map = calloc(inode_words, sizeof(uint64_t));
+	ndirty = 0;
+	inode_hint = 0;
+	if (!inode_table || !inode_dirty || !dirty_list || !inode_free_map) return 0;
+
+	if (superblock.inodesize) {
+		//blocks format never initialized are empty and not worth reading
+		int nlazy = superblock.nlazyblocks;
+		if (nlazy < 0 || nlazy > inode_blocks) nlazy = superblock.nlazyblocks = 0;
+		int nload = inode_blocks - nlazy;
+		memset(inode_table[nload].data, 0, nlazy * sizeof(union fs_block));
+
+		//every batch goes out before we wait for the first
+		int nreqs = (nload + SCAN_BATCH - 1) / SCAN_BATCH;
+		char **blockbufs = malloc(inode_blocks * sizeof(char *));
+		struct disk_request *reqs = calloc(nreqs, sizeof(struct disk_request));
+		if (!blockbufs || !reqs) {
+			free(blockbufs);
+			free(reqs);
+			return 0;
 		}
-		else if (i <= inode_blocks) {//inode blocks
-			//loop through inodes
-			int foundValid = 0;
-			for (int j = 0; j < INODES_PER_BLOCK; j++) {
-				//check validity
-				if (block.inode[j].isvalid) {
-					allocate_bitmap[i] = 1;
-					foundValid = 1;
-					//direct pointers
-					for (int k = 0; k < POINTERS_PER_INODE; k++) {
-						if(block.inode[j].direct[k]) allocate_bitmap[block.inode[j].direct[k]] = 1;
-					}
-					//indirect pointer
-					if (block.inode[j].indirect) {
-						//read
-						disk_read(block.inode[j].indirect, indirect_block.data);
-						for (int m = 0; m < POINTERS_PER_BLOCK; m++) {
-							if(indirect_block.pointers[m]) allocate_bitmap[indirect_block.pointers[m]] = 1;
-						}
-					}
+		for (int k = 0; k < nload; k++) blockbufs[k] = inode_table[k].data;
+		for (int r = 0; r < nreqs; r++) {
+			int first = r * SCAN_BATCH;
+			reqs[r].blocknum = first + 1;
+			reqs[r].count = (nload - first < SCAN_BATCH) ? nload - first : SCAN_BATCH;
+			reqs[r].data = blockbufs + first;
+		}
+		disk_submit(reqs, nreqs);
+		disk_wait(reqs, nreqs);
+		free(blockbufs);
+		free(reqs);
+	} else {
+		//older layout: read a batch at a time and widen each inode
+		union fs_block *raw = malloc(SCAN_BATCH * sizeof(union fs_block));
+		if (!raw) return 0;
+		memset(inode_table, 0, inode_table_blocks * sizeof(union fs_block));
+		for (int first = 0; first < inode_blocks; first += SCAN_BATCH) {
+			int n = (inode_blocks - first < SCAN_BATCH) ? inode_blocks - first : SCAN_BATCH;
+			for (int k = 0; k < n; k++) bufs[k] = raw[k].data;
+			disk_readv(first + 1, bufs, n);
+			for (int k = 0; k < n; k++) {
+				for (int j = 0; j < INODES_PER_BLOCK_V1; j++) {
+					struct fs_inode *inode = inode_get((first + k) * INODES_PER_BLOCK_V1 + j);
+					if (inode) inode_unpack(&superblock, &raw[k], j, inode);
 				}
 			}
-			if(!foundValid) allocate_bitmap[i] = 0;
 		}
+		free(raw);
+	}
+
+	//index the free inodes; inode 0 is never handed out
+	for (int i = 1; i < superblock.ninodes; i++) {
+		if (!inode_get(i)->isvalid) inode_free_set(i, 1);
 	}
+	return 1;
 }
 
-void fs_save_inode(int inode_number, struct fs_inode *node)
+/*
+The mount scan can be split across scan_threads workers, each taking a
+contiguous range of inode blocks from the resident inode table. They
+set bits with an atomic OR, so the merged bitmap is the same whatever
+order they run in, and free_blocks is recounted once they are done.
+
+Each worker reads the index blocks of its inodes a level at a time:
+first every root found in its range, then every index block those
+point to, and so on, with up to SCAN_BATCH reads in flight at once
+rather than one block at a time down each tree.
+*/
+struct scan_range {
+	int first;
+	int last;
+};
+
+static void scan_mark( int n )
 {
-	union fs_block block;
-	int block_number = inode_number / INODES_PER_BLOCK + 1;
-	int inode_index = inode_number % INODES_PER_BLOCK;
-	disk_read(block_number,block.data);
-	if(!block.inode[inode_index].isvalid) return;
-	block.inode[inode_index] = *node;	//expression must have pointer-to-object type
-	disk_write(block_number,block.data);
-	return;
+	if(n < 0 || n >= superblock.nblocks) return;
+	__atomic_fetch_or(&allocate_bitmap[n / BITS_PER_WORD], (uint64_t)1 << (n % BITS_PER_WORD), __ATOMIC_RELAXED);
 }
 
-void inode_load( int inumber, struct fs_inode *inode) {
-	union fs_block block;
-    int block_number = inumber / INODES_PER_BLOCK + 1;
-    int inode_index = inumber % INODES_PER_BLOCK;
-    disk_read(block_number, block.data);
-    *inode = block.inode[inode_index];
+//index blocks still to be scanned, each with its depth; depth 1 points at data
+struct scan_list {
+	int *blocks;
+	int *depths;
+	int n;
+	int max;
+};
+
+static void scan_add( struct scan_list *list, int blocknum, int depth )
+{
+	if (!blocknum) return;
+	scan_mark(blocknum);
+	if (list->n == list->max) {
+		int max = list->max ? list->max * 2 : SCAN_BATCH;
+		int *blocks = realloc(list->blocks, max * sizeof(int));
+		if (blocks) list->blocks = blocks;
+		int *depths = realloc(list->depths, max * sizeof(int));
+		if (depths) list->depths = depths;
+		if (!blocks || !depths) {
+			printf("fs: out of memory scanning the disk\n");
+			abort();
+		}
+		list->max = max;
+	}
+	list->blocks[list->n] = blocknum;
+	list->depths[list->n] = depth;
+	list->n++;
 }
 
-int fs_read(int inode_number, char *data, int length, int offset)
+static void scan_index( const union fs_block *index, int depth, struct scan_list *next )
 {
-if(!mounted){
-		printf("Error: the filesystem has not been mounted\n");
-		return 0;
+	for (int m = 0; m < POINTERS_PER_BLOCK; m++) {
+		if (!index->pointers[m]) continue;
+		if (depth > 1) scan_add(next, index->pointers[m], depth - 1);
+		else scan_mark(index->pointers[m]);
 	}
-	if(inode_number <= 0) {
-		return 0;
+}
+
+//scan every index block on the list, and then the level below them
+static void scan_levels( struct scan_list *list )
+{
+	union fs_block *bufs = malloc(SCAN_BATCH * sizeof(union fs_block));
+	struct disk_request reqs[SCAN_BATCH];
+	char *data[SCAN_BATCH];
+	int depths[SCAN_BATCH];
+
+	if (!bufs) {
+		printf("fs: out of memory scanning the disk\n");
+		abort();
 	}
 
+	while (list->n) {
+		struct scan_list next = { 0, 0, 0, 0 };
 
-	int inumber = inode_number % INODES_PER_BLOCK ;
-	int blk = inode_number/INODES_PER_BLOCK + 1;
-	int byte_offset = offset/4096;
-	int dblock = 0;
-    int bytes_read=0;
-	union fs_block block, indirect_block;
-	struct fs_inode inode;
-	char chunk_data[4096]="";
-	char all_data[4*4096]="";
-	
+		for (int first = 0; first < list->n; first += SCAN_BATCH) {
+			int n = (list->n - first < SCAN_BATCH) ? list->n - first : SCAN_BATCH;
+			int nreqs = 0;
 
+			for (int k = first; k < first + n; k++) {
+				//a mapped image is scanned in place
+				union fs_block *index = (union fs_block *)disk_borrow(list->blocks[k]);
+				if (index) {
+					scan_index(index, list->depths[k], &next);
+					disk_release(list->blocks[k], 0);
+					continue;
+				}
+				memset(&reqs[nreqs], 0, sizeof(reqs[nreqs]));
+				data[nreqs] = bufs[nreqs].data;
+				reqs[nreqs].blocknum = list->blocks[k];
+				reqs[nreqs].count = 1;
+				reqs[nreqs].data = &data[nreqs];
+				depths[nreqs] = list->depths[k];
+				nreqs++;
+			}
 
-	disk_read(blk, block.data);
-	
-	inode = block.inode[inumber];
-	int isize=inode.size;
+			disk_submit(reqs, nreqs);
+			disk_wait(reqs, nreqs);
+			for (int r = 0; r < nreqs; r++) scan_index(&bufs[r], depths[r], &next);
+		}
 
-	if((!inode.isvalid) || !isize) return 0;
+		free(list->blocks);
+		free(list->depths);
+		*list = next;
+	}
 
-	int bytes_left = ((isize-offset) < length) ? isize-offset : length;
+	free(bufs);
+}
 
-	for(int i=byte_offset; i<POINTERS_PER_INODE; i++)
-	{
-		dblock = inode.direct[i];
-		disk_read(dblock, *(&chunk_data));
-		strcat(*(&all_data), *(&chunk_data));
-		if(bytes_left-bytes_read < 4096)
-		{
-			bytes_read += bytes_left-bytes_read;
+static void * scan_inode_blocks( void *arg )
+{
+	struct scan_range *range = arg;
+	struct scan_list roots = { 0, 0, 0, 0 };
+	struct fs_inode *inode;
+
+	for (int b = range->first; b < range->last; b++) {
+		//loop through the resident inodes of this block
+		for (int j = 0; j < INODES_PER_BLOCK; j++) {
+			inode = &inode_table[b].inode[j];
+			//check validity
+			if (!inode->isvalid) continue;
+			//direct pointers
+			for (int k = 0; k < POINTERS_PER_INODE; k++) {
+				if(inode->direct[k]) scan_mark(inode->direct[k]);
+			}
+			//indirect trees
+			scan_add(&roots, inode->indirect, 1);
+			scan_add(&roots, inode->double_indirect, 2);
+			scan_add(&roots, inode->triple_indirect, 3);
 		}
-		else
-		{
-			bytes_read += 4096;
+	}
+	scan_levels(&roots);
+	return 0;
+}
+
+void update_Bmap(){
+	int nthreads = scan_threads;
+	if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > inode_table_blocks) nthreads = inode_table_blocks;
+	if (nthreads < 1) nthreads = 1;
+
+	pthread_t threads[nthreads];
+	struct scan_range ranges[nthreads];
+
+	//superblock, inode blocks and bitmap blocks are always in use
+	for (int i = 0; i < bitmap_start() + superblock.nbitmapblocks + superblock.njournalblocks; i++) scan_mark(i);
+
+	//split the inode blocks evenly between the workers
+	for (int t = 0; t < nthreads; t++) {
+		ranges[t].first = (long)inode_table_blocks * t / nthreads;
+		ranges[t].last  = (long)inode_table_blocks * (t + 1) / nthreads;
+	}
+
+	if (nthreads == 1) {
+		scan_inode_blocks(&ranges[0]);
+	} else {
+		int started;
+		for (started = 0; started < nthreads; started++) {
+			if (pthread_create(&threads[started], 0, scan_inode_blocks, &ranges[started])) break;
 		}
-		if(bytes_read >= bytes_left)
-		{
-			strcpy(data, all_data);
-			return bytes_read;
+		//anything we could not hand to a thread is scanned here
+		for (int t = started; t < nthreads; t++) scan_inode_blocks(&ranges[t]);
+		for (int t = 0; t < started; t++) pthread_join(threads[t], 0);
+	}
+
+	bitmap_recount();
+}
+
+void fs_set_scan_threads( int nthreads )
+{
+	scan_threads = nthreads;
+}
+
+/*
+An open file pins its inode (which is resident anyway) together with a
+flattened logical-to-physical block map: the direct pointers followed
+by the contents of the indirect block, so that map[POINTERS_PER_INODE]
+onwards is exactly the indirect block and can be written back as is.
+The map is read once at fs_open. Blocks past the map are found by
+walking the double- or triple-indirect tree; the index blocks along the
+way are kept in a small per-file cache (index, INDEX_SLOTS entries,
+least recently used goes first), so streaming through a large file
+touches the disk for an index block once per POINTERS_PER_BLOCK
+blocks. Opening an inode that is already open shares the same entry,
+so every handle sees the same map. Closed entries keep their map (and
+readahead state) until the slot is needed for another inode, so
+repeated fs_read calls on one file reuse it.
+*/
+struct fs_index {
+	int blocknum;
+	int dirty;
+	unsigned stamp;
+	int pointers[POINTERS_PER_BLOCK];
+};
+
+struct fs_file {
+	int inumber;
+	int refs;
+	int map[MAP_BLOCKS];
+	struct fs_index *index;
+	unsigned index_clock;
+	int seq_next;	//offset a sequential reader would ask for next
+	int ra_window;	//current readahead window in blocks, 0 when off
+	int ra_start;	//prefetched blocks not yet read are [ra_start, ra_next)
+	int ra_next;
+	char *wb_data;	//write-behind buffer for logical blocks [wb_first, wb_first + wb_count)
+	int wb_first;
+	int wb_count;
+	int wb_reserved;	//free blocks set aside for flushing it
+	int wb_size;	//file size counting the buffer, when that is past the inode's
+	bool unbuffered;	//a one-off handle from file_oneshot, always written through
+	pthread_mutex_t lock;	//index cache and readahead state, for concurrent readers
+};
+
+struct fs_file open_files[FS_MAX_OPEN];
+
+//the size of f's file, counting what is still in its write-behind buffer
+static int file_size( struct fs_file *f )
+{
+	int size = inode_get(f->inumber)->size;
+	return f->wb_size > size ? f->wb_size : size;
+}
+
+/*
+Write-behind: with writeback_max above zero, fs_pwrite only copies data
+into a per-file buffer covering one run of logical blocks. Nothing is
+allocated until the buffer is flushed, which happens when it fills up,
+when a write lands outside it, when its slot is taken by another inode
+and at fs_sync/fs_unmount. A partial tail block therefore stays in
+memory until the next append completes it, and each flush allocates the
+whole run as one extent. Blocks the buffer will need are counted in
+wb_reserved at write time so a flush never finds the disk full.
+
+A write past the end of the file only moves wb_size; the inode's size
+follows in file_write_blocks, as far as the blocks written cover it.
+Inodes go to disk a block of them at a time, so a size set any earlier
+could reach the disk with a sibling inode and point past data that was
+never written.
+*/
+int writeback_max = WB_DEFAULT_BLOCKS;
+int wb_reserved = 0;
+int wb_flushed = 0;
+
+static int file_flush( struct fs_file *f );
+static int file_pread( struct fs_file *f, char *data, int length, int offset );
+static int file_pwrite( struct fs_file *f, const char *data, int length, int offset );
+static int flush_all();
+static int inode_create();
+static int mount_disk();
+static int file_bmap( struct fs_file *f, int lblock );
+static void index_reset( struct fs_file *f );
+
+/*
+Readahead: fs_pread tracks whether each file is being read front to
+back. While it is, the window starts at RA_MIN_WINDOW blocks and doubles
+on every sequential read up to readahead_max; a read anywhere else
+switches it off again. The blocks in the window are handed to a
+background thread as physical runs, and it pulls them into the block
+cache with disk_prefetch while the caller is busy with the data it
+already has.
+*/
+struct ra_request {
+	int blocknum;
+	int count;
+};
+
+int readahead_max = RA_DEFAULT_WINDOW;
+int ra_prefetched = 0;
+int ra_hits = 0;
+int ra_wasted = 0;
+
+static struct ra_request ra_queue[RA_QUEUE];
+static int ra_head = 0;
+static int ra_count = 0;
+static bool ra_running = false;
+static bool ra_stop = false;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+static void * ra_worker( void *arg )
+{
+	struct ra_request req;
+
+	pthread_mutex_lock(&ra_lock);
+	while(1) {
+		while(!ra_count && !ra_stop) pthread_cond_wait(&ra_cond, &ra_lock);
+		if(!ra_count) break;
+		req = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE;
+		ra_count--;
+		pthread_mutex_unlock(&ra_lock);
+
+		disk_prefetch(req.blocknum, req.count);
+
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return 0;
+}
+
+static void ra_start_thread()
+{
+	if(ra_running || !readahead_max) return;
+	ra_stop = false;
+	ra_head = ra_count = 0;
+	ra_running = !pthread_create(&ra_thread, 0, ra_worker, 0);
+}
+
+static void ra_stop_thread()
+{
+	if(!ra_running) return;
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = true;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, 0);
+	ra_running = false;
+}
+
+/*
+Queue a run for the prefetch thread. The cache slots are reserved here,
+on the reader's side, so a read that overtakes the prefetch waits for
+it instead of fetching the same blocks a second time. Returns how many
+blocks were queued: fewer than count when the cache has no room left for
+readahead, and 0 when the queue is full.
+*/
+static int ra_submit( int blocknum, int count )
+{
+	pthread_mutex_lock(&ra_lock);
+	if(ra_count < RA_QUEUE) count = disk_reserve(blocknum, count);
+	else count = 0;
+	if(count) {
+		ra_queue[(ra_head + ra_count) % RA_QUEUE].blocknum = blocknum;
+		ra_queue[(ra_head + ra_count) % RA_QUEUE].count = count;
+		ra_count++;
+		pthread_cond_signal(&ra_cond);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return count;
+}
+
+//count prefetched blocks that were never read as wasted and reset the window
+static void ra_reset( struct fs_file *f )
+{
+	if(f->ra_next > f->ra_start) __atomic_add_fetch(&ra_wasted, f->ra_next - f->ra_start, __ATOMIC_RELAXED);
+	f->ra_window = 0;
+	f->ra_start = f->ra_next = 0;
+}
+
+static void readahead( struct fs_file *f, struct fs_inode *inode, int offset, int first_block, int last_block )
+{
+	if(!ra_running) return;
+
+	//blocks of this read that were prefetched for it
+	if(first_block < f->ra_next && last_block >= f->ra_start) {
+		int lo = (first_block > f->ra_start) ? first_block : f->ra_start;
+		int hi = (last_block < f->ra_next - 1) ? last_block : f->ra_next - 1;
+		__atomic_add_fetch(&ra_hits, hi - lo + 1, __ATOMIC_RELAXED);
+	}
+
+	if(offset == f->seq_next) {
+		f->ra_window = f->ra_window ? f->ra_window * 2 : RA_MIN_WINDOW;
+		if(f->ra_window > readahead_max) f->ra_window = readahead_max;
+	} else {
+		ra_reset(f);
+		return;
+	}
+	if(f->ra_start < last_block + 1) f->ra_start = last_block + 1;
+	if(f->ra_next < f->ra_start) f->ra_next = f->ra_start;
+
+	int nfile = (file_size(f) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int target = last_block + f->ra_window;
+	if(target > nfile - 1) target = nfile - 1;
+	if(target >= file_block_limit) target = file_block_limit - 1;
+
+	//hand the new part of the window over as physical runs
+	int lb = f->ra_next;
+	while(lb <= target) {
+		int start = file_bmap(f, lb);
+		if(!start) {
+			lb++;
+			continue;
 		}
-		
+		int n = 1;
+		while(lb + n <= target && file_bmap(f, lb + n) == start + n) n++;
+		int queued = ra_submit(start, n);
+		__atomic_add_fetch(&ra_prefetched, queued, __ATOMIC_RELAXED);
+		lb += queued;
+		if(queued < n) break;
 	}
+	if(f->ra_next < lb) f->ra_next = lb;
+}
+
+void fs_set_readahead( int maxblocks )
+{
+	readahead_max = (maxblocks > 0) ? maxblocks : 0;
+	if(!readahead_max) ra_stop_thread();
+	else if(mounted) ra_start_thread();
+}
 
+static struct fs_file * file_get( int fd )
+{
+	if(fd < 0 || fd >= FS_MAX_OPEN || !__atomic_load_n(&open_files[fd].refs, __ATOMIC_ACQUIRE)) return 0;
+	return &open_files[fd];
+}
 
-	disk_read(inode.indirect, indirect_block.data);
-	int i = 0;
-	if(byte_offset >= 5){i = byte_offset-5;}
-	for(; i<POINTERS_PER_BLOCK; i++) 
-	{
-		disk_read(indirect_block.pointers[i], *(&chunk_data));
-		strcat(*(&all_data), *(&chunk_data));
-		if(bytes_left-bytes_read < 4096)
-		{
-			bytes_read += bytes_left-bytes_read;
+//forget the cached map of inumber; called with files_lock held
+static void file_invalidate( int inumber )
+{
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+		struct fs_file *f = &open_files[fd];
+		if(f->inumber != inumber) continue;
+		ra_reset(f);
+		memset(f->map, 0, sizeof(f->map));
+		index_reset(f);
+		__atomic_sub_fetch(&wb_reserved, f->wb_reserved, __ATOMIC_RELAXED);
+		f->wb_reserved = 0;
+		f->wb_count = 0;
+		f->wb_size = 0;
+		if(!f->refs) f->inumber = 0;
+	}
+}
+
+//fs_open, but a full open file table returns -2 and says nothing
+static int file_open( int inumber )
+{
+	if(!mounted) {
+        printf("Filesystem is not mounted\n");
+        return -1;
+    }
+
+	struct fs_inode *inode = inode_get(inumber);
+	if(inumber < 1 || !inode){
+		printf("fs: Invalid inode number.\n");
+		return -1;
+	}
+
+	//fs_delete holds files_lock, so the inode stays valid while we do
+	pthread_mutex_lock(&files_lock);
+	if(!inode->isvalid){
+		pthread_mutex_unlock(&files_lock);
+		printf("fs: inode is invalid.\n");
+		return -1;
+	}
+
+	//reuse the entry for this inode, else an unused slot, else a closed one
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+		if(open_files[fd].inumber == inumber) {
+			__atomic_add_fetch(&open_files[fd].refs, 1, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&files_lock);
+			return fd;
 		}
-		else
-		{
-			bytes_read += 4096;
+	}
+
+	//a closed file whose buffered blocks cannot be placed keeps its slot
+	bool unflushed[FS_MAX_OPEN] = { false };
+	struct fs_file *f;
+	for(;;) {
+		int slot = -1;
+		for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+			if(open_files[fd].refs || unflushed[fd]) continue;
+			if(slot < 0 || (open_files[slot].inumber && !open_files[fd].inumber)) slot = fd;
 		}
+		if(slot < 0){
+			pthread_mutex_unlock(&files_lock);
+			return -2;
+		}
+		f = &open_files[slot];
+		if(!f->inumber) break;
+		inode_wrlock(f->inumber);
+		int flushed = file_flush(f);
+		inode_unlock(f->inumber);
+		if(flushed) break;
+		unflushed[slot] = true;
+	}
+	ra_reset(f);
+	index_reset(f);
+	inode_rdlock(inumber);
+	memset(f->map, 0, sizeof(f->map));
+	memcpy(f->map, inode->direct, sizeof(inode->direct));
+	if(inode->indirect) meta_read(inode->indirect, (char *)&f->map[POINTERS_PER_INODE]);
+	inode_unlock(inumber);
+	f->inumber = inumber;
+	__atomic_store_n(&f->refs, 1, __ATOMIC_RELEASE);
+	f->seq_next = 0;
+	f->wb_size = 0;
+	pthread_mutex_unlock(&files_lock);
+
+	return f - open_files;
+}
+
+int fs_open( int inumber )
+{
+	int fd = file_open(inumber);
 
-		if(bytes_read >= bytes_left)
-		{
-			strcpy(data, all_data);
-			return bytes_read;
+	if(fd == -2) {
+		printf("fs: Too many open files.\n");
+		return -1;
+	}
+	return fd;
+}
+
+/*
+fs_read and fs_write fall back on this when every slot in the open
+file table is taken. The handle lives on the stack for the one call
+and is never buffered. files_lock is held throughout, so no slot can
+open the inode meanwhile with a map of its own; if one already has,
+that slot is used instead.
+*/
+static int file_oneshot( int inumber, char *rdata, const char *wdata, int length, int offset )
+{
+	struct fs_file temp;
+	struct fs_file *f = &temp;
+	struct fs_inode *inode = inode_get(inumber);
+	int result = 0;
+
+	memset(&temp, 0, sizeof(temp));
+	temp.inumber = inumber;
+	temp.refs = 1;
+	temp.unbuffered = true;
+	pthread_mutex_init(&temp.lock, 0);
+
+	pthread_mutex_lock(&files_lock);
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+		if(open_files[fd].inumber == inumber) f = &open_files[fd];
+	}
+	if(wdata) inode_wrlock(inumber);
+	else inode_rdlock(inumber);
+	if(f == &temp && inode->isvalid) {
+		memcpy(temp.map, inode->direct, sizeof(inode->direct));
+		if(inode->indirect) meta_read(inode->indirect, (char *)&temp.map[POINTERS_PER_INODE]);
+	}
+	if(inode->isvalid) {
+		if(wdata) result = file_pwrite(f, wdata, length, offset);
+		else result = file_pread(f, rdata, length, offset);
+	}
+	inode_unlock(inumber);
+	pthread_mutex_unlock(&files_lock);
+
+	free(temp.index);
+	pthread_mutex_destroy(&temp.lock);
+	return result;
+}
+
+int fs_close( int fd )
+{
+	struct fs_file *f = file_get(fd);
+	if(!f) return 0;
+	pthread_mutex_lock(&files_lock);
+	__atomic_sub_fetch(&f->refs, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&files_lock);
+	return 1;
+}
+
+static int file_pread( struct fs_file *f, char *data, int length, int offset )
+{
+	union fs_block head, tail;
+	struct fs_inode *inode = inode_get(f->inumber);
+	int stack_blocks[READ_BATCH];
+	char *stack_bufs[READ_BATCH];
+	int *blocks = stack_blocks;
+	char **bufs = stack_bufs;
+
+	if(!inode->isvalid) return 0;
+	int size = file_size(f);
+	if(length <= 0 || offset < 0 || offset >= size) return 0;
+	if(length > size - offset) length = size - offset;
+
+	int first_block = offset / DISK_BLOCK_SIZE;
+	int last_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	//the whole range is requested at once; without memory for that, read less
+	if(last_block - first_block + 1 > READ_BATCH){
+		blocks = malloc((last_block - first_block + 1) * sizeof(int));
+		bufs = malloc((last_block - first_block + 1) * sizeof(char *));
+		if(!blocks || !bufs){
+			free(blocks);
+			free(bufs);
+			blocks = stack_blocks;
+			bufs = stack_bufs;
+			last_block = first_block + READ_BATCH - 1;
+			length = (last_block + 1) * DISK_BLOCK_SIZE - offset;
 		}
-		
 	}
-	
-	
-	return bytes_read;
+
+	int head_partial = offset % DISK_BLOCK_SIZE != 0;
+	int tail_partial = (offset + length) % DISK_BLOCK_SIZE != 0;
+
+	//start prefetching what comes next before we block on this read
+	pthread_mutex_lock(&f->lock);
+	readahead(f, inode, offset, first_block, last_block);
+	f->seq_next = offset + length;
+	pthread_mutex_unlock(&f->lock);
+
+	//whole blocks go straight into the caller's buffer, partial ones are staged;
+	//anything still sitting in the write-behind buffer is copied from there,
+	//and holes (no block mapped) are zeroes that need no I/O at all
+	int nread = 0;
+	pthread_mutex_lock(&f->lock);
+	for(int lb = first_block; lb <= last_block; lb++)
+	{
+		if(f->wb_count && lb >= f->wb_first && lb < f->wb_first + f->wb_count) continue;
+		char *buf;
+		if(lb == first_block && head_partial) buf = head.data;
+		else if(lb == last_block && tail_partial) buf = tail.data;
+		else buf = data + (lb * DISK_BLOCK_SIZE - offset);
+		blocks[nread] = file_bmap(f, lb);
+		if(!blocks[nread]){
+			memset(buf, 0, DISK_BLOCK_SIZE);
+			continue;
+		}
+		bufs[nread] = buf;
+		nread++;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	//one disk request per run of adjacent blocks, all in flight together
+	read_runs(blocks, bufs, nread);
+
+	for(int lb = first_block; lb <= last_block; lb++)
+	{
+		int start = (lb == first_block) ? offset % DISK_BLOCK_SIZE : 0;
+		int end = (lb == last_block) ? (offset + length - 1) % DISK_BLOCK_SIZE + 1 : DISK_BLOCK_SIZE;
+		char *dst = data + (lb * DISK_BLOCK_SIZE + start - offset);
+
+		if(f->wb_count && lb >= f->wb_first && lb < f->wb_first + f->wb_count)
+			memcpy(dst, f->wb_data + (lb - f->wb_first) * DISK_BLOCK_SIZE + start, end - start);
+		else if(lb == first_block && head_partial)
+			memcpy(dst, head.data + start, end - start);
+		else if(lb == last_block && tail_partial)
+			memcpy(dst, tail.data + start, end - start);
+	}
+
+	if(blocks != stack_blocks){
+		free(blocks);
+		free(bufs);
+	}
+	return length;
+}
+
+int fs_pread( int fd, char *data, int length, int offset )
+{
+	struct stats_timer t;
+	struct fs_file *f = file_get(fd);
+	int result = 0;
+
+	stats_begin(&t);
+	if(f) {
+		inode_rdlock(f->inumber);
+		result = file_pread(f, data, length, offset);
+		inode_unlock(f->inumber);
+	}
+	stats_end(STATS_FS_PREAD, &t, result);
+	return result;
+}
+
+int fs_read(int inode_number, char *data, int length, int offset)
+{
+if(!mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return 0;
+	}
+	if(inode_number <= 0) {
+		return 0;
+	}
+	if(!inode_get(inode_number) || !inode_get(inode_number)->isvalid) return 0;
+
+	struct stats_timer t;
+	stats_begin(&t);
+	int result = 0;
+	int fd = file_open(inode_number);
+	if(fd >= 0) {
+		result = fs_pread(fd, data, length, offset);
+		fs_close(fd);
+	} else if(fd == -2) {
+		result = file_oneshot(inode_number, data, 0, length, offset);
+	}
+	stats_end(STATS_FS_READ, &t, result);
+
+	return result;
 
 }
 
 int fs_create()
+{
+	struct stats_timer t;
+
+	stats_begin(&t);
+	int inumber = inode_create();
+	stats_end(STATS_FS_CREATE, &t, 0);
+	return inumber;
+}
+
+static int inode_create()
 {
 	if(!mounted) {
         printf("Filesystem is not mounted\n");
@@ -191,52 +1358,127 @@ int fs_create()
 
 
 	struct fs_inode node;
-	union fs_block block;
-	union fs_block supB;
 
-	disk_read(0,supB.data);//read super block
+	memset(&node, 0, sizeof(node));
+	node.isvalid = 1;
+
+	//take a free inode from the index
+	pthread_mutex_lock(&meta_lock);
+	int inumber = inode_alloc();
+	pthread_mutex_unlock(&meta_lock);
+	if(!inumber) return 0;
+
+	iblock_lock(inumber);
+	*inode_get(inumber) = node;
+	iblock_unlock(inumber);
+	inode_mark_dirty(inumber);
+	inode_sync();
+	return inumber;
+}
+
+int allocate_free_block(){
+	if(!free_count()) return -1;
+
+	// look for a word with a clear bit, starting where we left off
+	int fit = __atomic_load_n(&next_fit, __ATOMIC_RELAXED);
+	for (int k = 0; k < bitmap_words; k++){
+		int w = (fit + k) % bitmap_words;
+		uint64_t word;
+		while(~(word = __atomic_load_n(&allocate_bitmap[w], __ATOMIC_RELAXED))){
+			int i = w * BITS_PER_WORD + __builtin_ctzll(~word);
+			if(!bitmap_set(i)) continue;
+			__atomic_store_n(&next_fit, w, __ATOMIC_RELAXED);
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
 
-	node.size = 0;
-	node.isvalid = 1;
-	node.indirect = 0;
-	memset(node.direct, 0, sizeof(node.direct));
+/*
+Indirect blocks are taken from the top of the disk downwards, so they
+do not land in the middle of the data extents growing from the bottom.
+*/
+int allocate_meta_block(){
+	if(!free_count()) return -1;
+
+	int fit = __atomic_load_n(&meta_fit, __ATOMIC_RELAXED);
+	for (int k = 0; k < bitmap_words; k++){
+		int w = (fit - k + bitmap_words) % bitmap_words;
+		uint64_t word;
+		while(~(word = __atomic_load_n(&allocate_bitmap[w], __ATOMIC_RELAXED))){
+			int i = w * BITS_PER_WORD + 63 - __builtin_clzll(~word);
+			if(!bitmap_set(i)) continue;
+			__atomic_store_n(&meta_fit, w, __ATOMIC_RELAXED);
+			return i;
+		}
+	}
 
-	//check through every block
-	for(int i = 1; i < supB.super.nblocks; i++)
-	{
-		//ready block
+	return -1;
+}
 
-		disk_read(i,block.data);
+//count free blocks starting at start, stopping at max
+static int free_run_length( int start, int max )
+{
+	int len = 0;
+	while(len < max && start + len < superblock.nblocks && !bitmap_test(start + len)) len++;
+	return len;
+}
 
-		//check through every inode
-		for(int j = 1; j < INODES_PER_BLOCK; j++)
-		{
-			//if inode is not valid then assign to created node
-			if(!block.inode[j].isvalid)
-			{
+/*
+Reserve up to want contiguous blocks, preferring a run that starts at
+goal (normally just past the file's previous block) so that a file
+being extended stays physically sequential. Otherwise the first run of
+want blocks after next_fit is taken, or failing that the longest run
+seen. Returns the first block and stores the run length in got, or
+returns -1 if the disk is full.
+
+The run is claimed a block at a time from its start. If another thread
+gets to one of its blocks first, the part claimed so far is returned;
+if it took the very first block, the search starts over.
+*/
+int allocate_extent( int goal, int want, int *got ){
+	*got = 0;
+	if(want <= 0) return -1;
+
+	while(free_count()){
+		int best_start = -1;
+		int best_len = 0;
+
+		if(goal > 0 && goal < superblock.nblocks && !bitmap_test(goal)){
+			best_start = goal;
+			best_len = free_run_length(goal, want);
+		}
 
-				block.inode[j] = node;
-				allocate_bitmap[i] = 1;
-				disk_write(i, block.data);
-				return (i-1)*INODES_PER_BLOCK+j;
+		int fit = __atomic_load_n(&next_fit, __ATOMIC_RELAXED);
+		for (int k = 0; k < bitmap_words && best_len < want; k++){
+			int w = (fit + k) % bitmap_words;
+			if(!~__atomic_load_n(&allocate_bitmap[w], __ATOMIC_RELAXED)) continue;
+
+			for (int i = w * BITS_PER_WORD; i < (w + 1) * BITS_PER_WORD && i < superblock.nblocks; i++){
+				if(bitmap_test(i)) continue;
+				int len = free_run_length(i, want);
+				if(len > best_len){
+					best_start = i;
+					best_len = len;
+					if(len == want) break;
+				}
+				i += len;
 			}
 		}
-	}
-	return 0;
-}
 
-int allocate_free_block(){
-	union fs_block block;
-	disk_read(0,block.data);
+		if(best_start < 0) return -1;
 
-	// look for free block
-	for (int i = 0; i < block.super.nblocks; i++){
-		if(!allocate_bitmap[i]){
-			allocate_bitmap[i] = 1;
-			return i;
-		}
+		int len = 0;
+		while(len < best_len && bitmap_set(best_start + len)) len++;
+		if(!len) continue;
+
+		__atomic_store_n(&next_fit, (best_start + len - 1) / BITS_PER_WORD, __ATOMIC_RELAXED);
+		*got = len;
+		return best_start;
 	}
-	
+
 	return -1;
 }
 
@@ -249,36 +1491,76 @@ int fs_format()
         return 0;
     }
 	
-	union fs_block block;
-	disk_read(0,block.data);
 	int nblocks = disk_size();
 	int ninodeblocks = ceil(nblocks/10);
 	if(ninodeblocks == 0) ninodeblocks = 1;
 
-	for(int i = 1; i <= block.super.ninodeblocks; i++) {
-        union fs_block inode;
-        disk_read(i,inode.data);
-        for(int j = 0; j < INODES_PER_BLOCK; j++) {
-            inode.inode[j].isvalid = 0;
-        }
-        disk_write(i,inode.data);
-    }
+	//the inode blocks are left as they are; see nlazyblocks
+
+	int nbitmapblocks = (nblocks + DISK_BLOCK_SIZE*8 - 1) / (DISK_BLOCK_SIZE*8);
+	int njournalblocks = 0;
+	if(nblocks >= JOURNAL_MIN_DISK) {
+		njournalblocks = nblocks / 32;
+		if(njournalblocks < 16) njournalblocks = 16;
+		if(njournalblocks > JOURNAL_MAX_BLOCKS) njournalblocks = JOURNAL_MAX_BLOCKS;
+	}
+	int nmetablocks = 1 + ninodeblocks + nbitmapblocks + njournalblocks;
+
+	//write out a bitmap with only the metadata blocks in use
+	for(int i = 0; i < nbitmapblocks; i++) {
+		union fs_block bitmap;
+		memset(bitmap.data, 0, sizeof(bitmap.data));
+		for(int j = 0; j < DISK_BLOCK_SIZE*8; j++) {
+			int n = i*DISK_BLOCK_SIZE*8 + j;
+			if(n >= nmetablocks || n >= nblocks) break;
+			bitmap.words[j / BITS_PER_WORD] |= (uint64_t)1 << (j % BITS_PER_WORD);
+		}
+		if(1 + ninodeblocks + i < nblocks) disk_write(1 + ninodeblocks + i, bitmap.data);
+	}
+	if(njournalblocks) journal_format(1 + ninodeblocks + nbitmapblocks, njournalblocks);
 
 	union fs_block superblock;
+	memset(superblock.data, 0, sizeof(superblock.data));
 	superblock.super.magic = FS_MAGIC;
 	superblock.super.nblocks = nblocks;
 	superblock.super.ninodeblocks = ninodeblocks;
 	superblock.super.ninodes = (ninodeblocks * INODES_PER_BLOCK);
+	superblock.super.nbitmapblocks = nbitmapblocks;
+	superblock.super.inodesize = sizeof(struct fs_inode);
+	superblock.super.njournalblocks = njournalblocks;
+	superblock.super.nlazyblocks = ninodeblocks;
+	superblock.super.clean = 1;
     disk_write(0,superblock.data);
 
     return 1;
 }
 
+//print the data blocks under an index block, counting runs as we go
+static void debug_tree( int blocknum, int depth, int *prev, int *extents, int *ndatablocks )
+{
+	union fs_block index;
+
+	meta_read(blocknum, index.data);
+	for(int x = 0; x < POINTERS_PER_BLOCK; x++) {
+		int b = index.pointers[x];
+		if(!b) continue;
+		if(depth > 1) {
+			debug_tree(b, depth - 1, prev, extents, ndatablocks);
+			continue;
+		}
+		printf(" %d", b);
+		if(b != *prev+1) (*extents)++;
+		*prev = b;
+		(*ndatablocks)++;
+	}
+}
+
 void fs_debug()
 {
 	union fs_block block;
 	union fs_block temp;
 	union fs_block indirect;
+	int nfiles = 0, ndatablocks = 0, nextents = 0;
 	
 	disk_read(0,block.data);
 
@@ -286,365 +1568,857 @@ void fs_debug()
 	printf("    %d blocks\n",block.super.nblocks);
 	printf("    %d inode blocks\n",block.super.ninodeblocks);
 	printf("    %d inodes\n",block.super.ninodes);
+	if(block.super.nbitmapblocks) printf("    %d bitmap blocks\n",block.super.nbitmapblocks);
+	if(block.super.njournalblocks) printf("    %d journal blocks\n",block.super.njournalblocks);
+	if(mounted) block.super.nlazyblocks = superblock.nlazyblocks;
+	if(block.super.nlazyblocks) printf("    %d inode blocks not yet initialized\n",block.super.nlazyblocks);
+	if(mounted) block.super.rootdir = superblock.rootdir;
+	if(block.super.rootdir) printf("    root directory at inode %d\n",block.super.rootdir);
+	if(mounted) printf("    %d free blocks\n",free_blocks);
+	if(mounted) printf("readahead: max window %d blocks, %d prefetched, %d hits, %d wasted\n",
+		readahead_max, ra_prefetched, ra_hits, ra_wasted);
+	if(mounted) journal_stats();
+	if(mounted) {
+		int nbuffered = 0;
+		for(int fd = 0; fd < FS_MAX_OPEN; fd++) nbuffered += open_files[fd].wb_count;
+		printf("write-behind: max %d blocks per file, %d blocks buffered, %d blocks flushed\n",
+			writeback_max, nbuffered, wb_flushed);
+	}
 	
+	int per_block = superblock_inodes_per_block(&block.super);
     	for(int i = 1; i <= block.super.ninodeblocks; i++) {	//loop through inode blocks
-        disk_read(i,temp.data);
+        //the resident table may be ahead of the disk
+        if(mounted) memcpy(temp.data, inode_block_image(i-1, &indirect), sizeof(temp.data));
+        else if(i > block.super.ninodeblocks - block.super.nlazyblocks) memset(temp.data, 0, sizeof(temp.data));
+        else disk_read(i,temp.data);
         
-        for(int j = 0; j < INODES_PER_BLOCK; j++) {	//loop through inodes
-            if(temp.inode[j].isvalid == 1) {	//print if inode is valid
-                int inumber = (i-1)*INODES_PER_BLOCK + j;
+        for(int j = 0; j < per_block; j++) {	//loop through inodes
+            struct fs_inode node;
+            inode_unpack(&block.super, &temp, j, &node);
+            if(node.isvalid == 1) {	//print if inode is valid
+                int inumber = (i-1)*per_block + j;
                 printf("inode %d:\n", inumber);
-                printf("    size: %d bytes\n", temp.inode[j].size);
-		if(temp.inode[j].size == 0){
+                printf("    size: %d bytes\n", node.size);
+		if(node.size == 0){
 			continue;
 		}
                 
+		int extents = 0, prev = -2;
 		printf("    direct blocks:");
                 for(int k = 0; k < POINTERS_PER_INODE; k++) {	//loop through direct pointers
-                    if(temp.inode[j].direct[k] != 0) {
-                        printf(" %d", temp.inode[j].direct[k]);
+                    if(node.direct[k] != 0) {
+                        printf(" %d", node.direct[k]);
+                        if(node.direct[k] != prev+1) extents++;
+                        prev = node.direct[k];
+                        ndatablocks++;
                     }
                 }
                 printf("\n");
 		
-                if(temp.inode[j].indirect != 0) {	//inderect block
-                    printf("    indirect block: %d\n", temp.inode[j].indirect);
-                    disk_read(temp.inode[j].indirect, indirect.data);
-		
+                if(node.indirect != 0) {	//inderect block
+                    printf("    indirect block: %d\n", node.indirect);
                     printf("    indirect data blocks:");
-                    for(int x = 0; x < POINTERS_PER_BLOCK; x++) {	//loop through indirect data blocks
-                        if(indirect.pointers[x] != 0) {
-                            printf(" %d", indirect.pointers[x]);
-                        }
-                    }
+                    debug_tree(node.indirect, 1, &prev, &extents, &ndatablocks);
+                    printf("\n");
+                }
+                if(node.double_indirect != 0) {
+                    printf("    double indirect block: %d\n", node.double_indirect);
+                    printf("    double indirect data blocks:");
+                    debug_tree(node.double_indirect, 2, &prev, &extents, &ndatablocks);
+                    printf("\n");
+                }
+                if(node.triple_indirect != 0) {
+                    printf("    triple indirect block: %d\n", node.triple_indirect);
+                    printf("    triple indirect data blocks:");
+                    debug_tree(node.triple_indirect, 3, &prev, &extents, &ndatablocks);
                     printf("\n");
                 }
+                printf("    extents: %d\n", extents);	//runs of physically contiguous blocks
+                nfiles++;
+                nextents += extents;
             }
         }
     }
+
+	//a perfectly laid out file is a single extent
+	if(nfiles) {
+		printf("fragmentation: %d extents for %d data blocks in %d files (%.2f extents per file)\n",
+			nextents, ndatablocks, nfiles, (double)nextents/nfiles);
+	}
+}
+
+static void locks_init()
+{
+	for(int i = 0; i < INODE_LOCKS; i++) pthread_rwlock_init(&inode_locks[i], 0);
+	for(int i = 0; i < INODE_BLOCK_LOCKS; i++) pthread_mutex_init(&iblock_locks[i], 0);
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) pthread_mutex_init(&open_files[fd].lock, 0);
+}
+
+static void locks_destroy()
+{
+	for(int i = 0; i < INODE_LOCKS; i++) pthread_rwlock_destroy(&inode_locks[i]);
+	for(int i = 0; i < INODE_BLOCK_LOCKS; i++) pthread_mutex_destroy(&iblock_locks[i]);
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) pthread_mutex_destroy(&open_files[fd].lock);
 }
 
 int fs_mount()
 {
+	struct stats_timer t;
+
+	stats_begin(&t);
+	int result = mount_disk();
+	stats_end(STATS_FS_MOUNT, &t, 0);
+	return result;
+}
+
+static int mount_disk()
+{
+	//a second mount would drop the resident inodes and buffers
+	if(mounted) {
+		printf("Disk is already mounted\n");
+		return 0;
+	}
+
 	//Read 0 block from disk
 	union fs_block block;
 	disk_read(0,block.data);
 	//Check for magic number
 	if(block.super.magic != FS_MAGIC) return 0;
-	//say if mounted
-	mounted = 1;
+	superblock = block.super;
 	//Allocate bitmap (calloc)
-	allocate_bitmap = calloc(block.super.nblocks,sizeof(int));
-	if(!allocate_bitmap) return 0;
-	inode_blocks = block.super.ninodeblocks;
-	//Update bitmap function
-	update_Bmap();
+	if(!bitmap_init(superblock.nblocks)) return 0;
+	inode_blocks = superblock.ninodeblocks;
+	inodes_per_block = superblock_inodes_per_block(&superblock);
+	file_block_limit = superblock.inodesize ? MAP_BLOCKS + DOUBLE_BLOCKS + TRIPLE_BLOCKS : MAP_BLOCKS;
+	//Bring the home blocks up to the last commit
+	if(superblock.njournalblocks) {
+		int replayed = journal_open(bitmap_start() + superblock.nbitmapblocks, superblock.njournalblocks, superblock.nblocks);
+		if(replayed < 0) return 0;
+		if(replayed) printf("fs: replayed %d journal transactions\n", replayed);
+		//the replay may have moved the inode watermark on or set the root
+		if(replayed) {
+			disk_read(0, block.data);
+			superblock.nlazyblocks = block.super.nlazyblocks;
+			superblock.rootdir = block.super.rootdir;
+		}
+	}
+	//Load inode table
+	memset(open_files, 0, sizeof(open_files));
+	if(!inode_table_load()) return 0;
+	//Trust the saved bitmap only after a clean unmount or a journal replay
+	if(superblock.nbitmapblocks && (superblock.clean || superblock.njournalblocks)) {
+		bitmap_load();
+	} else {
+		update_Bmap();
+	}
+	//Mark the filesystem in use until fs_unmount
+	if(superblock.nbitmapblocks) {
+		superblock.clean = 0;
+		superblock_save();
+		disk_flush();
+	}
+	locks_init();
 	mounted = 1;
+	ra_start_thread();
 
 	return 1;
 }
 
+int fs_unmount()
+{
+	if(!mounted) return 0;
 
+	ra_stop_thread();
 
-int fs_delete( int inumber )
-{
-	if(!mounted) {
-        printf("Filesystem is not mounted\n");
-        return 0;
-    }
-	union fs_block block;
-	union fs_block in_block;
+	//inodes and bitmap must be on disk before the clean flag is
+	flush_all();
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+		free(open_files[fd].wb_data);
+		free(open_files[fd].index);
+	}
+	inode_sync();
+	if(journal_active()) {
+		pthread_mutex_lock(&meta_lock);
+		fs_commit();
+		journal_checkpoint();
+		journal_close();
+		pthread_mutex_unlock(&meta_lock);
+	}
+	if(superblock.nbitmapblocks) {
+		bitmap_save();
+		disk_flush();
+		superblock.clean = 1;
+		superblock_save();
+	}
+	disk_flush();
+
+	free(inode_table);
+	free(inode_dirty);
+	free(dirty_list);
+	free(inode_free_map);
+	free(allocate_bitmap);
+	free(bitmap_dirty);
+	inode_table = 0;
+	inode_dirty = 0;
+	dirty_list = 0;
+	inode_free_map = 0;
+	allocate_bitmap = 0;
+	bitmap_dirty = 0;
+	locks_destroy();
+	memset(open_files, 0, sizeof(open_files));
+	mounted = 0;
+
+	return 1;
+}
 
-	if(inumber > inode_blocks*INODES_PER_BLOCK - 1 || inumber < 0) return 0; //impossible inodes fails automatically
 
-	//find location
-	int blk = inumber/INODES_PER_BLOCK + 1; //get block number for inode
-	int localIndex = inumber%INODES_PER_BLOCK; //get local index for inode
 
-	//read block
-	disk_read(blk, block.data);
+/*
+Does any index block of this tree still have an image in the journal?
+Such an image must not be checkpointed or replayed over whatever reuses
+the block once it is freed; depth 1 points at data.
+*/
+static int tree_logged( int blocknum, int depth )
+{
+	union fs_block index;
 
-	//Check validity
-	if(!block.inode[localIndex].isvalid) return 0;
-	//iterate through direct pointers
-	for(int i=0;i<POINTERS_PER_INODE;i++){
-		if(!block.inode[localIndex].direct[i]) continue;
-		allocate_bitmap[block.inode[localIndex].direct[i]] = 0;
-	}
-	//iterate through indirect pointers
-	if(block.inode[localIndex].indirect){	
-		disk_read(block.inode[localIndex].indirect, in_block.data);
-		for(int j=0; j<POINTERS_PER_BLOCK; j++){
-			if(!in_block.pointers[j]) continue;
-			allocate_bitmap[in_block.pointers[j]] = 0;
-		}
+	if(!blocknum) return 0;
+	pthread_mutex_lock(&meta_lock);
+	int logged = journal_holds(blocknum);
+	pthread_mutex_unlock(&meta_lock);
+	if(logged || depth == 1) return logged;
+
+	meta_read(blocknum, index.data);
+	for(int j = 0; j < POINTERS_PER_BLOCK; j++){
+		if(tree_logged(index.pointers[j], depth - 1)) return 1;
+	}
+	return 0;
+}
+
+//give back an index block and everything under it
+static void tree_free( int blocknum, int depth )
+{
+	union fs_block index;
+
+	if(!blocknum) return;
+	meta_read(blocknum, index.data);
+	for(int j = 0; j < POINTERS_PER_BLOCK; j++){
+		if(!index.pointers[j]) continue;
+		if(depth > 1) tree_free(index.pointers[j], depth - 1);
+		else bitmap_clear(index.pointers[j]);
 	}
+	bitmap_clear(blocknum);
+}
 
-	//size update
-	block.inode[localIndex].size = 0;
+//called with files_lock and the inode's lock held
+static int inode_delete( int inumber )
+{
+	struct fs_inode *inode;
 
-	//invalidate inode
-	block.inode[localIndex].isvalid = 0;
+	//find resident inode
+	inode = inode_get(inumber);
 
-	//Check all inodes in inode block for any valid inode
-	int foundValidInode = 0;
-	for(int k=0; k<INODES_PER_BLOCK; k++){
-		if(block.inode[k].isvalid){
-			foundValidInode = 1;
-			break;
-		}
+	//Check validity
+	if(!inode->isvalid) return 0;
+
+	//freed index blocks may be reused for data by anyone; empty the journal before that can happen
+	if(tree_logged(inode->indirect, 1) || tree_logged(inode->double_indirect, 2) ||
+	   tree_logged(inode->triple_indirect, 3)){
+		pthread_mutex_lock(&meta_lock);
+		fs_commit();
+		journal_checkpoint();
+		pthread_mutex_unlock(&meta_lock);
 	}
 
-	//invalidate block
-	if(!foundValidInode) allocate_bitmap[blk] = 0;
-	
+	//iterate through direct pointers
+	for(int i=0;i<POINTERS_PER_INODE;i++){
+		if(!inode->direct[i]) continue;
+		bitmap_clear(inode->direct[i]);
+	}
+	//free the indirect trees
+	tree_free(inode->indirect, 1);
+	tree_free(inode->double_indirect, 2);
+	tree_free(inode->triple_indirect, 3);
+
+	//clear the pointers, size update, invalidate inode
+	iblock_lock(inumber);
+	inode->indirect = inode->double_indirect = inode->triple_indirect = 0;
+	inode->size = 0;
+	inode->isvalid = 0;
+	iblock_unlock(inumber);
+
+	pthread_mutex_lock(&meta_lock);
+	inode_free_set(inumber, 1);
+	pthread_mutex_unlock(&meta_lock);
+	file_invalidate(inumber);
+
 	//write to disk
-	disk_write(blk, block.data);
-	
+	inode_mark_dirty(inumber);
+	inode_sync();
+
 	return 1;
 }
 
-int fs_getsize( int inumber )
+int fs_delete( int inumber )
 {
 	if(!mounted) {
         printf("Filesystem is not mounted\n");
         return 0;
     }
-	struct fs_inode inode;
 
-	inode_load(inumber, &inode);
+	if(inumber >= superblock.ninodes || inumber < 1) return 0; //impossible inodes fails automatically
+	if(inumber == fs_getroot()) {
+		printf("fs: cannot delete the root directory\n");
+		return 0;
+	}
 
-	if(inode.isvalid == 0){
-		printf("fs: inode is invalid.\n");
-		return -1;
-	}	
+	struct stats_timer t;
+	stats_begin(&t);
+	pthread_mutex_lock(&files_lock);
+	inode_wrlock(inumber);
+	int result = inode_delete(inumber);
+	inode_unlock(inumber);
+	pthread_mutex_unlock(&files_lock);
+	stats_end(STATS_FS_DELETE, &t, 0);
 
-	return inode.size;
+	return result;
 }
 
-
-int fs_write( int inumber, const char *data, int length, int offset )
-{	
+int fs_getsize( int inumber )
+{
 	if(!mounted) {
         printf("Filesystem is not mounted\n");
         return 0;
     }
-	union fs_block block;
-	union fs_block temp;
-	union fs_block indirect;
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("fs: inode is invalid.\n");
+		return -1;
+	}
 
-	disk_read(0,block.data);
+	struct stats_timer t;
+	stats_begin(&t);
+	pthread_mutex_lock(&files_lock);
+	inode_rdlock(inumber);
+	int size = inode->isvalid ? inode->size : -1;
+	for(int fd = 0; fd < FS_MAX_OPEN && size >= 0; fd++) {
+		if(open_files[fd].inumber == inumber && open_files[fd].wb_size > size) size = open_files[fd].wb_size;
+	}
+	inode_unlock(inumber);
+	pthread_mutex_unlock(&files_lock);
+	stats_end(STATS_FS_GETSIZE, &t, 0);
 
-	if(inumber > block.super.ninodes || inumber < 1){
-		printf("fs: Invalid inode number.\n");
-		return 0;
+	if(size < 0) printf("fs: inode is invalid.\n");
+	return size;
+}
+
+
+/*
+Turn a logical block past the flat map into the root pointer in the
+inode and the slot to follow at each level below it. Returns the depth.
+*/
+static int bmap_path( struct fs_inode *inode, int lblock, int **root, int *slots )
+{
+	int rel = lblock - MAP_BLOCKS;
+	if(rel < DOUBLE_BLOCKS){
+		*root = &inode->double_indirect;
+		slots[0] = rel / POINTERS_PER_BLOCK;
+		slots[1] = rel % POINTERS_PER_BLOCK;
+		return 2;
+	}
+	rel -= DOUBLE_BLOCKS;
+	*root = &inode->triple_indirect;
+	slots[0] = rel / DOUBLE_BLOCKS;
+	slots[1] = rel / POINTERS_PER_BLOCK % POINTERS_PER_BLOCK;
+	slots[2] = rel % POINTERS_PER_BLOCK;
+	return 3;
+}
+
+//the cached copy of index block blocknum; fresh means it was just allocated and is all zeroes
+static struct fs_index * index_get( struct fs_file *f, int blocknum, int fresh )
+{
+	if(!f->index){
+		f->index = calloc(INDEX_SLOTS, sizeof(struct fs_index));
+		if(!f->index) return 0;
 	}
-	int block_of_inode = (inumber / INODES_PER_BLOCK) + 1;
 
-	disk_read(block_of_inode, block.data);
+	struct fs_index *victim = &f->index[0];
+	for(int i = 0; i < INDEX_SLOTS; i++){
+		struct fs_index *e = &f->index[i];
+		if(e->blocknum == blocknum){
+			e->stamp = ++f->index_clock;
+			return e;
+		}
+		if(e->stamp < victim->stamp) victim = e;
+	}
 
-	int inode_offset = inumber % INODES_PER_BLOCK;
+	if(victim->blocknum && victim->dirty) meta_write(victim->blocknum, (const char *)victim->pointers);
+	victim->blocknum = blocknum;
+	victim->dirty = fresh;
+	victim->stamp = ++f->index_clock;
+	if(fresh){
+		memset(victim->pointers, 0, sizeof(victim->pointers));
+	}else{
+		meta_read(blocknum, (char *)victim->pointers);
+	}
+	return victim;
+}
 
+//write back the index blocks f has changed
+static void index_flush( struct fs_file *f )
+{
+	if(!f->index) return;
+	for(int i = 0; i < INDEX_SLOTS; i++){
+		struct fs_index *e = &f->index[i];
+		if(!e->blocknum || !e->dirty) continue;
+		meta_write(e->blocknum, (const char *)e->pointers);
+		e->dirty = 0;
+	}
+}
 
-	struct fs_inode ind = block.inode[inode_offset];  // TODO dont forget to write to disk
-	size_t bytes_written = 0;
+static void index_reset( struct fs_file *f )
+{
+	if(!f->index) return;
+	memset(f->index, 0, INDEX_SLOTS * sizeof(struct fs_index));
+	f->index_clock = 0;
+}
 
-	if(ind.isvalid == 0){
-		printf("fs: inode is invalid.\n");
+//physical block behind logical block lblock of f, 0 if there is none
+static int file_bmap( struct fs_file *f, int lblock )
+{
+	if(lblock < MAP_BLOCKS) return f->map[lblock];
+
+	int *root, slots[3];
+	int depth = bmap_path(inode_get(f->inumber), lblock, &root, slots);
+	int blocknum = *root;
+	for(int d = 0; d < depth && blocknum; d++){
+		struct fs_index *e = index_get(f, blocknum, 0);
+		if(!e) return 0;
+		blocknum = e->pointers[slots[d]];
+	}
+	return blocknum;
+}
+
+//allocate and cache an empty index block, or return 0 if the disk is full
+static int index_alloc( struct fs_file *f )
+{
+	int blocknum = allocate_meta_block();
+	if(blocknum == -1) return 0;
+	if(!index_get(f, blocknum, 1)){
+		bitmap_clear(blocknum);
 		return 0;
 	}
-	
-	if(ind.isvalid == 1){
-		
-		int free_block;
-		int start_block;
-		int numblocks;
-		int direct_ptrs_used;
-		int indirect_ptrs_used;
-		bool indirect_used = false;
-
-		// check if you have to start from a new block	
-		int isBlockFull = offset % DISK_BLOCK_SIZE;	
-
-		if(isBlockFull == 0){ 
-			// have to write to an empty block
-
-			// check how many direct pointers and indirect pointers used
-			start_block = offset / DISK_BLOCK_SIZE + 1;
-			if(start_block > POINTERS_PER_INODE){
-				direct_ptrs_used   = POINTERS_PER_INODE;
-				indirect_ptrs_used = start_block - POINTERS_PER_INODE - 1;
-				indirect_used      = true;
-			}else{
-				direct_ptrs_used = start_block - 1; 
-				indirect_ptrs_used = 0;
+	return blocknum;
+}
+
+//point logical block lblock of f at pblock, growing the tree on the way; 0 if the disk is full
+static int file_bmap_set( struct fs_file *f, int lblock, int pblock )
+{
+	if(lblock < MAP_BLOCKS){
+		f->map[lblock] = pblock;
+		return 1;
+	}
+
+	int *root, slots[3];
+	int depth = bmap_path(inode_get(f->inumber), lblock, &root, slots);
+	if(!*root){
+		int blocknum = index_alloc(f);
+		if(!blocknum) return 0;
+		iblock_lock(f->inumber);
+		*root = blocknum;
+		iblock_unlock(f->inumber);
+		inode_mark_dirty(f->inumber);
+	}
+
+	int blocknum = *root;
+	for(int d = 0; d < depth - 1; d++){
+		struct fs_index *e = index_get(f, blocknum, 0);
+		if(!e) return 0;
+		if(!e->pointers[slots[d]]){
+			int child = index_alloc(f);
+			if(!child) return 0;
+			//the parent may have been pushed out to make room
+			e = index_get(f, blocknum, 0);
+			if(!e) return 0;
+			e->pointers[slots[d]] = child;
+			e->dirty = 1;
+		}
+		blocknum = e->pointers[slots[d]];
+	}
+
+	struct fs_index *leaf = index_get(f, blocknum, 0);
+	if(!leaf) return 0;
+	leaf->pointers[slots[depth - 1]] = pblock;
+	leaf->dirty = 1;
+	return 1;
+}
+
+//how many index blocks mapping lblock would add to f
+static int bmap_missing( struct fs_file *f, int lblock )
+{
+	struct fs_inode *inode = inode_get(f->inumber);
+	if(lblock < POINTERS_PER_INODE) return 0;
+	if(lblock < MAP_BLOCKS) return !inode->indirect;
+
+	int *root, slots[3];
+	int depth = bmap_path(inode, lblock, &root, slots);
+	int blocknum = *root;
+	for(int d = 0; d < depth - 1; d++){
+		if(!blocknum) return depth - d;
+		struct fs_index *e = index_get(f, blocknum, 0);
+		if(!e) return depth - d;
+		blocknum = e->pointers[slots[d]];
+	}
+	return !blocknum;
+}
+
+/*
+Map n whole blocks of f starting at logical block first_block, taking
+any that are not allocated yet from contiguous extents, and write
+bufs[] to them. The inode and indirect block are brought up to date.
+Returns how many blocks were written, which is short only when the disk
+fills up.
+*/
+static int file_write_blocks( struct fs_file *f, int first_block, const char **bufs, int numblocks )
+{
+	struct fs_inode *ind = inode_get(f->inumber);
+	bool indirect_dirty = false;
+
+	int *blocks = malloc(numblocks * sizeof(int));
+	if(!blocks) return 0;
+
+	// new blocks come out of contiguous extents sized to the rest of the write
+	int extent_next = 0;
+	int extent_left = 0;
+	int goal = (first_block > 0) ? file_bmap(f, first_block - 1) : 0;
+	if(goal) goal++;
+
+	int n;
+	for(n = 0; n < numblocks; n++){
+		int lblock = first_block + n;
+		int pblock = file_bmap(f, lblock);
+
+		if(lblock >= POINTERS_PER_INODE && lblock < MAP_BLOCKS && !ind->indirect){
+			int free_block = allocate_meta_block();
+			if(free_block == -1){
+				printf("fs: Cannot allocate a block.\n");
+				break;
 			}
-			// compute how many blocks we need to write to
-			numblocks   = length / DISK_BLOCK_SIZE + 1;
-			
-		}else{
-			// block is not full. we have to fill data block first
-
-			// block which block needs to be filld and where to start filling from
-			int finish_block = offset / DISK_BLOCK_SIZE + 1;
-			int data_start_index = (offset+1) % DISK_BLOCK_SIZE;
-
-			// check where data block we want to fill is
-			int read_index;
-			if(finish_block > POINTERS_PER_INODE){
-				int indirect_addr = ind.indirect;
-				disk_read(indirect_addr, indirect.data);
-				read_index = indirect.pointers[finish_block - POINTERS_PER_INODE - 1];
-				if(read_index > POINTERS_PER_BLOCK){
-					printf("fs: indirect block is full\n");
-
-					// write to disk the return	
-					block.inode[inode_offset] = ind;
-					disk_write(block_of_inode,block.data);
-					if(indirect_used) disk_write(ind.indirect, indirect.data);
-					return 0;
+			iblock_lock(f->inumber);
+			ind->indirect = free_block;
+			iblock_unlock(f->inumber);
+			indirect_dirty = true;
+		}
+
+		if(!pblock){
+			if(!extent_left){
+				extent_next = allocate_extent(goal, numblocks - n, &extent_left);
+				if(extent_next == -1){
+					printf("fs: Cannot allocate a block.\n");
+					break;
 				}
-				disk_read(read_index, temp.data);
-				
-			}else{
-				read_index = ind.direct[finish_block-1];
-				disk_read( read_index, temp.data);
 			}
-			
-			// fill incomplete block
-			bool blockFull = (length - (DISK_BLOCK_SIZE - data_start_index)) > 0;
-			if(blockFull){
-				for(int i = data_start_index; i < DISK_BLOCK_SIZE; i++){
-					temp.data[i] = data[i-data_start_index];
-				}
-				disk_write(read_index, temp.data);
-				bytes_written += (DISK_BLOCK_SIZE - data_start_index);
-				ind.size += (DISK_BLOCK_SIZE - data_start_index);
-			}else{
-				for(int i = data_start_index; i < data_start_index + length; i++){
-					temp.data[i] = data[i-data_start_index];
-				}
-				disk_write(read_index, temp.data);
-				bytes_written += (DISK_BLOCK_SIZE - data_start_index);
-				ind.size += (DISK_BLOCK_SIZE - data_start_index);
-
-				// write to disk the return	
-				block.inode[inode_offset] = ind;
-				disk_write(block_of_inode,block.data);
-				if(indirect_used) disk_write(ind.indirect, indirect.data);
-				return bytes_written;
+			if(!file_bmap_set(f, lblock, extent_next)){
+				printf("fs: Cannot allocate a block.\n");
+				break;
 			}
-			
-			// compute which block needs to be written to 
-			start_block = offset / DISK_BLOCK_SIZE + 2;
-			
-			// find how many direct and indirect blocks have been used
-			if(start_block > POINTERS_PER_INODE){
-				direct_ptrs_used   = POINTERS_PER_INODE;
-				indirect_ptrs_used = start_block - POINTERS_PER_INODE - 1;
-				indirect_used      = true;
+			pblock = extent_next++;
+			extent_left--;
+			if(lblock >= POINTERS_PER_INODE && lblock < MAP_BLOCKS) indirect_dirty = true;
+		}
+		blocks[n] = pblock;
+		goal = pblock + 1;
+	}
+
+	// give back whatever the last extent reserved but did not use
+	while(extent_left > 0){
+		bitmap_clear(extent_next++);
+		extent_left--;
+	}
+
+	// one disk request per run of physically adjacent blocks
+	write_runs(blocks, bufs, n);
+	free(blocks);
+
+	index_flush(f);
+	if(indirect_dirty) meta_write(ind->indirect, (const char *)&f->map[POINTERS_PER_INODE]);
+	//a buffered size goes to disk only as far as the blocks just written
+	int end = (first_block + n) * DISK_BLOCK_SIZE;
+	iblock_lock(f->inumber);
+	memcpy(ind->direct, f->map, sizeof(ind->direct));
+	if(f->wb_size > ind->size) ind->size = (f->wb_size < end) ? f->wb_size : end;
+	iblock_unlock(f->inumber);
+	inode_mark_dirty(f->inumber);
+	inode_sync();
+
+	return n;
+}
+
+/*
+Write out whatever f has buffered. Returns 0 if some of it could not be
+placed; that part stays buffered, so the caller must not reuse f.
+*/
+static int file_flush( struct fs_file *f )
+{
+	if(!f->wb_count) return 1;
+
+	const char *bufs[WB_MAX_BLOCKS];
+	for(int i = 0; i < f->wb_count; i++) bufs[i] = f->wb_data + i * DISK_BLOCK_SIZE;
+
+	//the blocks are about to be allocated for real
+	__atomic_sub_fetch(&wb_reserved, f->wb_reserved, __ATOMIC_RELAXED);
+	f->wb_reserved = 0;
+
+	int count = f->wb_count;
+	int n = file_write_blocks(f, f->wb_first, bufs, count);
+	__atomic_add_fetch(&wb_flushed, n, __ATOMIC_RELAXED);
+	f->wb_count = 0;
+	if(n < count) {
+		memmove(f->wb_data, f->wb_data + n * DISK_BLOCK_SIZE, (count - n) * DISK_BLOCK_SIZE);
+		f->wb_first += n;
+		f->wb_count = count - n;
+	}
+
+	return n == count;
+}
+
+//flush every write-behind buffer; 0 if some of it could not be placed
+static int flush_all()
+{
+	int ok = 1;
+
+	pthread_mutex_lock(&files_lock);
+	for(int fd = 0; fd < FS_MAX_OPEN; fd++) {
+		struct fs_file *f = &open_files[fd];
+		if(!f->inumber) continue;
+		inode_wrlock(f->inumber);
+		if(!file_flush(f)) ok = 0;
+		inode_unlock(f->inumber);
+	}
+	pthread_mutex_unlock(&files_lock);
+	return ok;
+}
+
+void fs_set_writeback( int maxblocks )
+{
+	if(maxblocks < 0) maxblocks = 0;
+	if(maxblocks > WB_MAX_BLOCKS) maxblocks = WB_MAX_BLOCKS;
+	if(mounted) flush_all();
+	writeback_max = maxblocks;
+}
+
+int fs_getroot()
+{
+	if(!mounted) return 0;
+	pthread_mutex_lock(&meta_lock);
+	int inumber = superblock.rootdir;
+	pthread_mutex_unlock(&meta_lock);
+	return inumber;
+}
+
+/*
+Record inumber as the root directory. The superblock goes through the
+journal when there is one, so a checkpoint of an older image logged by
+fs_commit cannot put the previous root back.
+*/
+int fs_setroot( int inumber )
+{
+	union fs_block buf;
+
+	if(!mounted || inumber < 0 || inumber >= superblock.ninodes) return 0;
+	pthread_mutex_lock(&meta_lock);
+	superblock.rootdir = inumber;
+	if(journal_active()) {
+		memset(buf.data, 0, sizeof(buf.data));
+		buf.super = superblock;
+		journal_log(0, buf.data);
+		fs_commit();
+	} else {
+		superblock_save();
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return 1;
+}
+
+int fs_sync()
+{
+	if(!mounted) return 0;
+	int ok = flush_all();
+	inode_sync();
+	if(journal_active()) {
+		pthread_mutex_lock(&meta_lock);
+		fs_commit();
+		pthread_mutex_unlock(&meta_lock);
+	}
+	disk_flush();
+	return ok;
+}
+
+/* The old write-through path: map and write the touched blocks right away. */
+static int write_through( struct fs_file *f, const char *data, int length, int offset, int last_block )
+{
+	union fs_block head;
+	union fs_block tail;
+
+	int first_block = offset / DISK_BLOCK_SIZE;
+	int numblocks = last_block - first_block + 1;
+
+	const char **bufs = malloc(numblocks * sizeof(char *));
+	if(!bufs) return 0;
+
+	// stage the partial blocks, merging with what is already there
+	for(int n = 0; n < numblocks; n++){
+		int lblock = first_block + n;
+		int block_start = (lblock == first_block) ? offset % DISK_BLOCK_SIZE : 0;
+		int block_end   = (lblock == last_block) ? (offset + length - 1) % DISK_BLOCK_SIZE + 1 : DISK_BLOCK_SIZE;
+		const char *src = data + (lblock * DISK_BLOCK_SIZE + block_start - offset);
+
+		if(block_start == 0 && block_end == DISK_BLOCK_SIZE){
+			// full block, written straight from the caller's buffer
+			bufs[n] = src;
+		}else{
+			union fs_block *stage = (lblock == first_block) ? &head : &tail;
+			int pblock = file_bmap(f, lblock);
+			if(!pblock){
+				memset(stage->data, 0, sizeof(stage->data));
 			}else{
-				direct_ptrs_used = start_block - 1; 
-				indirect_ptrs_used = 0;
+				disk_read(pblock, stage->data);
 			}
-			// compute the number of blocks need to write data
-			numblocks   = (length - bytes_written) / DISK_BLOCK_SIZE + 1;
+			memcpy(stage->data + block_start, src, block_end - block_start);
+			bufs[n] = stage->data;
 		}
-		
-		// while there are blocks to be filid
-		while(numblocks > 0){
+	}
 
-			if(direct_ptrs_used < POINTERS_PER_INODE){
-				
-				free_block = allocate_free_block();
-				if(free_block == -1){
-					printf("fs: Cannot allocate a block.\n");
-					block.inode[inode_offset] = ind;
-					disk_write(block_of_inode,block.data);
-					if(indirect_used) disk_write(ind.indirect, indirect.data);
-					return bytes_written;
-				}
+	int n = file_write_blocks(f, first_block, bufs, numblocks);
+	free(bufs);
 
-				ind.direct[direct_ptrs_used] = free_block;
-
-				if(numblocks-1 == 0){
-					for(int i = 0; i < length - bytes_written; i++){
-						temp.data[i] = data[i + bytes_written];
-					}		
-					disk_write(free_block,temp.data);
-					int t = length - bytes_written;
-					bytes_written += t;
-					ind.size += t;	
-				}else{
-					for(int i = 0; i < DISK_BLOCK_SIZE; i++){
-						temp.data[i] = data[i + bytes_written];
-					}		
-					disk_write(free_block,temp.data);
-					bytes_written += DISK_BLOCK_SIZE;
-					ind.size += DISK_BLOCK_SIZE;
-				}
-				numblocks--;
-				direct_ptrs_used++;
-
-			}else if (indirect_ptrs_used < POINTERS_PER_BLOCK){
-
-				if (!indirect_used)	{
-					free_block = allocate_free_block();
-					if(free_block == -1){
-						printf("fs: Cannot allocate a block.\n");
-						block.inode[inode_offset] = ind;
-						disk_write(block_of_inode,block.data);
-						if(indirect_used) disk_write(ind.indirect, indirect.data);
-						return bytes_written;
-					}
-					ind.indirect = free_block; 
-				}
-				
-				free_block = allocate_free_block();
-				if(free_block == -1){
+	if(n == numblocks) return length;
+	return (n > 0) ? (first_block + n) * DISK_BLOCK_SIZE - offset : 0;
+}
+
+static int file_pwrite( struct fs_file *f, const char *data, int length, int offset )
+{
+	struct fs_inode *ind = inode_get(f->inumber);
+	int bytes_written = 0;
+
+	if(ind->isvalid == 0){
+		printf("fs: inode is invalid.\n");
+		return 0;
+	}
+	if(length <= 0 || offset < 0) return 0;
+	if(length > INT_MAX - offset) length = INT_MAX - offset;
+
+	// logical blocks touched by this write
+	int first_block = offset / DISK_BLOCK_SIZE;
+	int last_block  = (offset + length - 1) / DISK_BLOCK_SIZE;
+	if(last_block >= file_block_limit){
+		printf("All of inodes used\n");
+		last_block = file_block_limit - 1;
+		if(last_block < first_block) return 0;
+		length = file_block_limit * DISK_BLOCK_SIZE - offset;
+	}
+
+	if(!writeback_max || f->unbuffered){
+		//anything still buffered would shadow what is written here
+		if(f->wb_count && !file_flush(f)) return 0;
+		bytes_written = write_through(f, data, length, offset, last_block);
+		if(offset + bytes_written > ind->size){
+			iblock_lock(f->inumber);
+			ind->size = offset + bytes_written;
+			iblock_unlock(f->inumber);
+			inode_mark_dirty(f->inumber);
+			inode_sync();
+		}
+		return bytes_written;
+	}
+
+	if(!f->wb_data){
+		f->wb_data = malloc(WB_MAX_BLOCKS * DISK_BLOCK_SIZE);
+		if(!f->wb_data) return 0;
+	}
+
+	while(bytes_written < length){
+		int pos = offset + bytes_written;
+		int lblock = pos / DISK_BLOCK_SIZE;
+		int block_start = pos % DISK_BLOCK_SIZE;
+		int count = DISK_BLOCK_SIZE - block_start;
+		if(count > length - bytes_written) count = length - bytes_written;
+
+		// the buffer holds one run of logical blocks; start a new one if this does not extend it
+		if(f->wb_count && (lblock < f->wb_first || lblock > f->wb_first + f->wb_count ||
+		   lblock - f->wb_first >= writeback_max)){
+			if(!file_flush(f)) break;
+		}
+		if(!f->wb_count) f->wb_first = lblock;
+
+		char *buf = f->wb_data + (lblock - f->wb_first) * DISK_BLOCK_SIZE;
+		if(lblock == f->wb_first + f->wb_count){
+			// a block new to the buffer; it needs disk space by the time it is flushed
+			int pblock = file_bmap(f, lblock);
+			if(!pblock){
+				//index blocks are counted where the buffer first reaches them
+				int need = 1;
+				bool index_start = lblock == POINTERS_PER_INODE ||
+					(lblock >= MAP_BLOCKS && (lblock - MAP_BLOCKS) % POINTERS_PER_BLOCK == 0);
+				if(lblock == f->wb_first || index_start) need += bmap_missing(f, lblock);
+				if(free_count() - __atomic_add_fetch(&wb_reserved, need, __ATOMIC_RELAXED) < 0){
+					__atomic_sub_fetch(&wb_reserved, need, __ATOMIC_RELAXED);
 					printf("fs: Cannot allocate a block.\n");
-					block.inode[inode_offset] = ind;
-					disk_write(block_of_inode,block.data);
-					if(indirect_used) disk_write(ind.indirect, indirect.data);
-					return bytes_written;
-				}
-				
-				indirect.pointers[indirect_ptrs_used] = free_block;
-
-				if(numblocks-1 == 0){
-					for(int i = 0; i < length - bytes_written; i++){
-						temp.data[i] = data[i + bytes_written];
-					}		
-					disk_write(free_block,temp.data);
-					int t = length - bytes_written;
-					bytes_written += t;
-					ind.size += t;	
-					
-				}else{
-					for(int i = 0; i < DISK_BLOCK_SIZE; i++){
-						temp.data[i] = data[i + bytes_written];
-					}		
-					disk_write(free_block,temp.data);
-					bytes_written += DISK_BLOCK_SIZE;
-					ind.size += DISK_BLOCK_SIZE;
+					break;
 				}
-				
-				indirect_ptrs_used++;
-				numblocks--;
-			}else{
-				printf("All of inodes used\n");
-				block.inode[inode_offset] = ind;
-				disk_write(block_of_inode,block.data);
-				if(indirect_used) disk_write(ind.indirect, indirect.data);
-				return bytes_written; 
+				f->wb_reserved += need;
 			}
-
+			if(count < DISK_BLOCK_SIZE && pblock){
+				disk_read(pblock, buf);
+			}else if(count < DISK_BLOCK_SIZE){
+				memset(buf, 0, DISK_BLOCK_SIZE);
+			}
+			f->wb_count++;
 		}
-		
-		block.inode[inode_offset] = ind;
-		disk_write(block_of_inode,block.data);
-		if(indirect_used) disk_write(ind.indirect, indirect.data);
+		memcpy(buf + block_start, data + bytes_written, count);
+		bytes_written += count;
 	}
-		
+
+	// the inode's size follows once the data is flushed
+	if(offset + bytes_written > file_size(f)) f->wb_size = offset + bytes_written;
+
 	return bytes_written;
 }
+
+int fs_pwrite( int fd, const char *data, int length, int offset )
+{
+	struct stats_timer t;
+	struct fs_file *f = file_get(fd);
+	int result = 0;
+
+	stats_begin(&t);
+	if(f) {
+		inode_wrlock(f->inumber);
+		result = file_pwrite(f, data, length, offset);
+		inode_unlock(f->inumber);
+	}
+	stats_end(STATS_FS_PWRITE, &t, result);
+	return result;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	if(!mounted) {
+        printf("Filesystem is not mounted\n");
+        return 0;
+    }
+
+	struct stats_timer t;
+	stats_begin(&t);
+	int result = 0;
+	int fd = file_open(inumber);
+	if(fd >= 0) {
+		result = fs_pwrite(fd, data, length, offset);
+		fs_close(fd);
+	} else if(fd == -2) {
+		result = file_oneshot(inumber, 0, data, length, offset);
+	}
+	stats_end(STATS_FS_WRITE, &t, result);
+
+	return result;
+}
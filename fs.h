@@ -4,6 +4,14 @@
 void fs_debug();
 int  fs_format();
 int  fs_mount();
+int  fs_unmount();
+void fs_set_scan_threads( int nthreads );
+void fs_set_readahead( int maxblocks );
+void fs_set_writeback( int maxblocks );
+int  fs_sync();
+
+int  fs_getroot();
+int  fs_setroot( int inumber );
 
 int  fs_create();
 int  fs_delete( int inumber );
@@ -13,4 +21,9 @@ int  fs_getsize();
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
 
+int  fs_open( int inumber );
+int  fs_pread( int fd, char *data, int length, int offset );
+int  fs_pwrite( int fd, const char *data, int length, int offset );
+int  fs_close( int fd );
+
 #endif
\ No newline at end of file
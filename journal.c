@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC  0x4a524e4c
+#define JOURNAL_DESC   0x44455343
+#define JOURNAL_COMMIT 0x434f4d54
+#define DESC_SLOTS     (DISK_BLOCK_SIZE / sizeof(int) - 4)
+
+/*
+The journal is a header block followed by a circular log. Metadata
+blocks handed to journal_log are collected in memory into the running
+transaction, and journal_commit writes that transaction to the log as
+one sequential run: a descriptor listing the home block numbers, the
+block images, and a commit block carrying a checksum over them. Only
+once a transaction is in the log may its blocks reach their home
+locations; that happens lazily, in journal_checkpoint, when the log
+runs out of room or the journal is closed. Until then the newest image
+of every logged block is kept in entries, and journal_lookup serves
+reads from there.
+
+The header records where the oldest transaction not yet checkpointed
+starts and the sequence number it carries. journal_open replays every
+complete transaction from there on, in order, so after a crash the home
+blocks end up as they were at the last commit. Every block of a
+transaction also carries the id journal_format gave the header, so
+transactions left in the log by an earlier filesystem never replay,
+wherever that one put its journal.
+
+journal_log never commits on its own: only the caller knows when the
+blocks logged so far agree with each other, so it has to commit before
+the running transaction grows past journal_room. When a commit finds
+the rest of the log too small for it, the transactions already in the
+log are checkpointed first. A block logged again after its last commit
+gets a new entry rather than overwriting that one, so the committed
+image is still there for the checkpoint to write home.
+*/
+
+struct journal_header {
+	int magic;
+	uint32_t id;
+	int seq;
+	int head;
+};
+
+struct journal_desc {
+	int magic;
+	uint32_t id;
+	int seq;
+	int count;
+	int blocknums[DESC_SLOTS];
+};
+
+struct journal_commit_block {
+	int magic;
+	uint32_t id;
+	int seq;
+	int count;
+	uint32_t checksum;
+};
+
+union journal_block {
+	struct journal_header header;
+	struct journal_desc desc;
+	struct journal_commit_block commit;
+	char data[DISK_BLOCK_SIZE];
+};
+
+struct journal_entry {
+	int blocknum;
+	int running;	//the image here is newer than anything in the log
+	char data[DISK_BLOCK_SIZE];
+};
+
+static int jstart=0;	//header block; the log follows it
+static int jsize=0;	//blocks in the log, 0 when there is no journal
+static uint32_t jid=0;	//format id every log block must carry
+static int jseq=0;	//sequence number of the next transaction
+static int jhead=0;	//log offset of the oldest transaction not checkpointed
+static int jused=0;	//log blocks written since the last checkpoint
+
+static struct journal_entry *entries=0;
+static int nentries=0;
+static int *entry_slot=0;	//home block number -> index in entries, or -1
+static int *running=0;
+static int nrunning=0;
+static int *order=0;	//entries sorted by home block, for writing them out
+static const char **bufs=0;
+static struct disk_request *reqs=0;
+
+static int ncommits=0;
+static int nlogged=0;
+static int ncheckpoints=0;
+static int nhomewrites=0;
+
+static uint32_t checksum( uint32_t sum, const char *data )
+{
+	for(int i=0;i<DISK_BLOCK_SIZE;i++) {
+		sum ^= (unsigned char)data[i];
+		sum *= 16777619;
+	}
+	return sum;
+}
+
+static void header_write()
+{
+	union journal_block block;
+
+	memset(block.data,0,sizeof(block.data));
+	block.header.magic = JOURNAL_MAGIC;
+	block.header.id = jid;
+	block.header.seq = jseq;
+	block.header.head = jhead;
+	disk_write(jstart,block.data);
+}
+
+//write n blocks to the log starting at offset pos, wrapping at the end
+static void log_write( int pos, const char **data, int n )
+{
+	pos %= jsize;
+	int first = (n < jsize-pos) ? n : jsize-pos;
+	disk_writev(jstart+1+pos,data,first);
+	if(first<n) disk_writev(jstart+1,data+first,n-first);
+}
+
+static void log_read( int pos, char *data )
+{
+	disk_read(jstart+1+pos%jsize,data);
+}
+
+//an id for a new format, never the one the old header at start carries
+static uint32_t format_id( int start )
+{
+	union journal_block block;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	uint32_t id = ((uint32_t)ts.tv_sec * 2654435761u) ^ (uint32_t)ts.tv_nsec ^ ((uint32_t)getpid() << 16);
+	disk_read(start,block.data);
+	if(block.header.magic==JOURNAL_MAGIC && block.header.id==id) id++;
+	return id;
+}
+
+void journal_format( int start, int nblocks )
+{
+	union journal_block block;
+
+	if(nblocks<4) return;
+
+	uint32_t id = format_id(start);
+
+	//an empty first log block, so nothing left over there replays
+	memset(block.data,0,sizeof(block.data));
+	disk_write(start+1,block.data);
+
+	block.header.magic = JOURNAL_MAGIC;
+	block.header.id = id;
+	block.header.seq = 1;
+	block.header.head = 0;
+	disk_write(start,block.data);
+}
+
+/*
+Set up the journal in the nblocks blocks at start and replay whatever
+was committed but not checkpointed. Returns the number of transactions
+replayed, or -1 if the journal could not be set up.
+*/
+int journal_open( int start, int nblocks, int disk_blocks )
+{
+	union journal_block header, desc, commit;
+	int pos, seq, replayed=0, scanned=0;
+
+	journal_close();
+	if(nblocks<4) return 0;
+
+	jstart = start;
+	jsize = nblocks-1;
+	if(jsize>DESC_SLOTS+2) jsize = DESC_SLOTS+2;
+
+	//committed images and the running transaction can each fill the log
+	entries = malloc(2*jsize*sizeof(struct journal_entry));
+	entry_slot = malloc(disk_blocks*sizeof(int));
+	running = malloc(2*jsize*sizeof(int));
+	order = malloc(2*jsize*sizeof(int));
+	bufs = malloc((2*jsize+2)*sizeof(char *));
+	reqs = malloc(2*jsize*sizeof(struct disk_request));
+	if(!entries || !entry_slot || !running || !order || !bufs || !reqs) {
+		journal_close();
+		return -1;
+	}
+	for(int i=0;i<disk_blocks;i++) entry_slot[i] = -1;
+
+	disk_read(jstart,header.data);
+	if(header.header.magic!=JOURNAL_MAGIC) {
+		jid = format_id(jstart);
+		jseq = 1;
+		jhead = 0;
+		header_write();
+		return 0;
+	}
+
+	jid = header.header.id;
+	pos = header.header.head % jsize;
+	seq = header.header.seq;
+
+	while(scanned<jsize) {
+		log_read(pos,desc.data);
+		if(desc.desc.magic!=JOURNAL_DESC || desc.desc.id!=jid || desc.desc.seq!=seq) break;
+		int count = desc.desc.count;
+		if(count<1 || count>jsize-2) break;
+
+		uint32_t sum = 2166136261u;
+		int ok = 1;
+		for(int k=0;k<count;k++) {
+			log_read(pos+1+k,entries[k].data);
+			sum = checksum(sum,entries[k].data);
+			if(desc.desc.blocknums[k]<0 || desc.desc.blocknums[k]>=disk_blocks) ok = 0;
+		}
+		log_read(pos+1+count,commit.data);
+		if(!ok || commit.commit.magic!=JOURNAL_COMMIT || commit.commit.id!=jid || commit.commit.seq!=seq ||
+		   commit.commit.count!=count || commit.commit.checksum!=sum) break;
+
+		for(int k=0;k<count;k++) disk_write(desc.desc.blocknums[k],entries[k].data);
+
+		pos = (pos+count+2)%jsize;
+		scanned += count+2;
+		seq++;
+		replayed++;
+	}
+
+	jseq = seq;
+	jhead = pos;
+	if(replayed) {
+		disk_flush();
+		header_write();
+		disk_flush();
+	}
+	return replayed;
+}
+
+void journal_close()
+{
+	free(entries);
+	free(entry_slot);
+	free(running);
+	free(order);
+	free(bufs);
+	free(reqs);
+	entries = 0;
+	entry_slot = 0;
+	running = 0;
+	order = 0;
+	bufs = 0;
+	reqs = 0;
+	nentries = nrunning = 0;
+	jsize = jused = 0;
+}
+
+int journal_active()
+{
+	return jsize>0;
+}
+
+static int entry_compare( const void *a, const void *b )
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	if(entries[x].blocknum!=entries[y].blocknum) return entries[x].blocknum - entries[y].blocknum;
+	return x - y;
+}
+
+/*
+Write the committed entries home, or all of them if all is set, and
+drop them. Only the newest image of each block is written; the running
+entries that are kept move down to the front of entries.
+*/
+static void write_home( int all )
+{
+	int start, end, n=0, nreqs=0;
+
+	for(int i=0;i<nentries;i++) {
+		if(all || !entries[i].running) order[n++] = i;
+	}
+	qsort(order,n,sizeof(int),entry_compare);
+
+	//home blocks go out in order, one request per run of adjacent blocks, all in flight together
+	int m = 0;
+	for(int k=0;k<n;k++) {
+		if(k+1<n && entries[order[k+1]].blocknum==entries[order[k]].blocknum) continue;
+		order[m] = order[k];
+		bufs[m++] = entries[order[k]].data;
+	}
+	for(start=0;start<m;start=end) {
+		for(end=start+1;end<m && entries[order[end]].blocknum==entries[order[end-1]].blocknum+1;end++);
+		memset(&reqs[nreqs],0,sizeof(reqs[nreqs]));
+		reqs[nreqs].blocknum = entries[order[start]].blocknum;
+		reqs[nreqs].count = end-start;
+		reqs[nreqs].data = (char **)bufs+start;
+		reqs[nreqs].write = 1;
+		nreqs++;
+	}
+	disk_submit(reqs,nreqs);
+	disk_wait(reqs,nreqs);
+	disk_flush();
+	nhomewrites += m;
+
+	for(int i=0;i<nentries;i++) entry_slot[entries[i].blocknum] = -1;
+	if(all) nrunning = 0;
+	//running[] is in entry order, so each entry only ever moves down
+	for(int k=0;k<nrunning;k++) {
+		if(running[k]!=k) entries[k] = entries[running[k]];
+		running[k] = k;
+		entry_slot[entries[k].blocknum] = k;
+	}
+	nentries = nrunning;
+}
+
+//checkpoint the transactions in the log, leaving the running one be
+static void checkpoint_committed()
+{
+	if(!jused) return;
+
+	//the log must be on disk before any home block is overwritten
+	disk_flush();
+	write_home(0);
+
+	jhead = (jhead+jused)%jsize;
+	jused = 0;
+	header_write();
+	disk_flush();
+	ncheckpoints++;
+}
+
+//add the current contents of blocknum to the running transaction
+void journal_log( int blocknum, const char *data )
+{
+	int i;
+
+	if(!jsize) {
+		disk_write(blocknum,data);
+		return;
+	}
+
+	i = entry_slot[blocknum];
+	if(i>=0 && entries[i].running) {
+		memcpy(entries[i].data,data,DISK_BLOCK_SIZE);
+		return;
+	}
+
+	//only when the caller let the running transaction outgrow the log
+	if(nentries==2*jsize) checkpoint_committed();
+	if(nentries==2*jsize) {
+		printf("journal: transaction too large, writing it in place\n");
+		write_home(1);
+	}
+
+	i = nentries++;
+	entries[i].blocknum = blocknum;
+	entry_slot[blocknum] = i;
+	entries[i].running = 1;
+	memcpy(entries[i].data,data,DISK_BLOCK_SIZE);
+	running[nrunning++] = i;
+}
+
+//copy the newest logged image of blocknum into data, if there is one
+int journal_lookup( int blocknum, char *data )
+{
+	if(!jsize || entry_slot[blocknum]<0) return 0;
+	memcpy(data,entries[entry_slot[blocknum]].data,DISK_BLOCK_SIZE);
+	return 1;
+}
+
+//is an image of blocknum waiting to be checkpointed?
+int journal_holds( int blocknum )
+{
+	return jsize && entry_slot[blocknum]>=0;
+}
+
+int journal_pending()
+{
+	return nrunning;
+}
+
+//blocks the running transaction may still grow by and be committed whole
+int journal_room()
+{
+	return jsize ? jsize-2-nrunning : 0;
+}
+
+void journal_commit()
+{
+	union journal_block desc, commit;
+	uint32_t sum = 2166136261u;
+
+	if(!jsize || !nrunning) return;
+
+	if(jused+nrunning+2>jsize) checkpoint_committed();
+	if(nrunning+2>jsize) {
+		printf("journal: transaction too large, writing it in place\n");
+		write_home(1);
+		return;
+	}
+
+	memset(desc.data,0,sizeof(desc.data));
+	desc.desc.magic = JOURNAL_DESC;
+	desc.desc.id = jid;
+	desc.desc.seq = jseq;
+	desc.desc.count = nrunning;
+	bufs[0] = desc.data;
+	for(int k=0;k<nrunning;k++) {
+		struct journal_entry *e = &entries[running[k]];
+		desc.desc.blocknums[k] = e->blocknum;
+		bufs[k+1] = e->data;
+		sum = checksum(sum,e->data);
+		e->running = 0;
+	}
+
+	memset(commit.data,0,sizeof(commit.data));
+	commit.commit.magic = JOURNAL_COMMIT;
+	commit.commit.id = jid;
+	commit.commit.seq = jseq;
+	commit.commit.count = nrunning;
+	commit.commit.checksum = sum;
+	bufs[nrunning+1] = commit.data;
+
+	log_write(jhead+jused,bufs,nrunning+2);
+
+	jused += nrunning+2;
+	jseq++;
+	ncommits++;
+	nlogged += nrunning;
+	nrunning = 0;
+}
+
+//write every logged block home and empty the log
+void journal_checkpoint()
+{
+	if(!jsize) return;
+	journal_commit();
+	checkpoint_committed();
+}
+
+void journal_stats()
+{
+	if(!jsize) return;
+	printf("journal: %d blocks, %d commits, %d blocks logged, %d checkpoints, %d home writes\n",
+		jsize+1,ncommits,nlogged,ncheckpoints,nhomewrites);
+}
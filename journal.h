@@ -0,0 +1,18 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+void journal_format( int start, int nblocks );
+int  journal_open( int start, int nblocks, int disk_blocks );
+void journal_close();
+int  journal_active();
+
+void journal_log( int blocknum, const char *data );
+int  journal_lookup( int blocknum, char *data );
+int  journal_holds( int blocknum );
+int  journal_pending();
+int  journal_room();
+void journal_commit();
+void journal_checkpoint();
+void journal_stats();
+
+#endif
@@ -1,176 +1,695 @@
 #include "fs.h"
+#include "dir.h"
 #include "disk.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
+#define STRESS_MAX_THREADS 64
+#define STRESS_BYTES (32 << 20)
+#define SCRIPT_MAX_LINES 65536
+#define COPY_RING 4
+#define COPY_CHUNK_MIN 16384
+#define COPY_CHUNK_DEFAULT (1 << 20)
+
+static int timing=0;
+static int copy_chunk=COPY_CHUNK_DEFAULT;
+
+static int run_line( const char *line, int iteration );
+static int run_script( const char *filename );
+static int do_command( const char *line );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_stress( int inumber, int nthreads );
+static int do_stats_dump( const char *filename );
+static int resolve( const char *arg, int create );
+static void list_entry( void *ctx, const char *name, int inumber, int isdir );
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	const char *script=0;
+	int result;
+	int cacheblocks=-1, queuedepth=-1, mapped=0;
+
+	for(int i=3;i<argc;i++) {
+		if(!strcmp(argv[i],"-m")) {
+			mapped = 1;
+		} else if(!strcmp(argv[i],"-c") && i+1<argc) {
+			cacheblocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-t") && i+1<argc) {
+			fs_set_scan_threads(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-r") && i+1<argc) {
+			fs_set_readahead(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-w") && i+1<argc) {
+			fs_set_writeback(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-q") && i+1<argc) {
+			queuedepth = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-f") && i+1<argc) {
+			script = argv[++i];
+		} else if(!strcmp(argv[i],"-T")) {
+			timing = 1;
+		} else if(!strcmp(argv[i],"-b") && i+1<argc) {
+			copy_chunk = atoi(argv[++i]);
+			if(copy_chunk<COPY_CHUNK_MIN) copy_chunk = COPY_CHUNK_MIN;
+		} else {
+			argc = 0;
+			break;
+		}
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc<3) {
+		printf("use: %s <diskfile> <nblocks> [-c cacheblocks] [-t scanthreads] [-r readahead] [-w writebehind] [-q queuedepth] [-f script] [-T] [-b copychunk] [-m]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(mapped) {
+		result = disk_init_mapped(argv[1],atoi(argv[2]));
+	} else {
+		result = disk_init(argv[1],atoi(argv[2]));
+	}
+
+	if(!result) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
+	if(cacheblocks>=0) disk_cache_resize(cacheblocks);
+	if(queuedepth>=0) disk_set_queue_depth(queuedepth);
+
 	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
 
-	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+	if(script) {
+		run_script(script);
+	} else {
+		while(1) {
+			printf(" simplefs> ");
+			fflush(stdout);
+
+			if(!fgets(line,sizeof(line),stdin)) break;
+
+			if(line[0]=='\n') continue;
+			line[strlen(line)-1] = 0;
+
+			if(!run_line(line,0)) break;
+		}
+	}
+
+	fs_unmount();
+	printf("closing emulated disk.\n");
+	disk_close();
+
+	return 0;
+}
+
+/*
+Replace every $i in line with iteration, the count of the innermost
+loop or repeat, starting at 1.
+*/
+static void expand( const char *line, int iteration, char *out, int size )
+{
+	int n = 0;
+
+	while(*line && n<size-1) {
+		if(line[0]=='$' && line[1]=='i') {
+			n += snprintf(out+n,size-n,"%d",iteration);
+			if(n>size-1) n = size-1;
+			line += 2;
+		} else {
+			out[n++] = *line++;
+		}
+	}
+	out[n] = 0;
+}
+
+/*
+Run one line, expanding $i and handling repeat and timing, and print how
+long it took and the block I/O it caused when timing is on. Returns 0 if
+the shell should quit.
+*/
+static int run_line( const char *line, int iteration )
+{
+	char expanded[1024];
+	char word[1024];
+	char arg[1024];
+	int count, skip=0, reads, writes, more;
+	struct timespec start, end;
+
+	if(sscanf(line,"%s %d %n",word,&count,&skip)==2 && !strcmp(word,"repeat") && skip) {
+		for(int i=1;i<=count;i++) {
+			if(!run_line(line+skip,i)) return 0;
+		}
+		return 1;
+	}
+
+	expand(line,iteration,expanded,sizeof(expanded));
+
+	if(sscanf(expanded,"%s %s",word,arg)==2 && !strcmp(word,"timing")) {
+		timing = !strcmp(arg,"on");
+		return 1;
+	}
+
+	//cat writes through a stream of its own
+	fflush(stdout);
+
+	reads = disk_read_count();
+	writes = disk_write_count();
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	more = do_command(expanded);
+
+	if(timing) {
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		printf("time: %s: %.3f ms, %d block reads, %d block writes\n",expanded,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+			disk_read_count() - reads,disk_write_count() - writes);
+	}
+	return more;
+}
+
+//index of the end matching the loop at lines[first], or -1
+static int loop_end( char **lines, int first, int last )
+{
+	char word[1024];
+	int depth = 0;
+
+	for(int i=first;i<last;i++) {
+		if(sscanf(lines[i],"%s",word)!=1) continue;
+		if(!strcmp(word,"loop")) depth++;
+		if(!strcmp(word,"end") && --depth==0) return i;
+	}
+	return -1;
+}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+/*
+Run lines [first,last) of a script, with iteration as the value of $i.
+"loop <count>" runs everything up to its matching "end" count times.
+Returns 0 once a command asks the shell to quit or the script is bad.
+*/
+static int run_lines( char **lines, int first, int last, int iteration )
+{
+	char word[1024];
+	int count;
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+	for(int i=first;i<last;i++) {
+		if(sscanf(lines[i],"%s",word)!=1 || word[0]=='#') continue;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+		if(!strcmp(word,"loop")) {
+			int end = loop_end(lines,i,last);
+			if(end<0 || sscanf(lines[i],"%*s %d",&count)!=1) {
+				printf("script: line %d: use loop <count> ... end\n",i+1);
+				return 0;
+			}
+			for(int k=1;k<=count;k++) {
+				if(!run_lines(lines,i+1,end,k)) return 0;
+			}
+			i = end;
+		} else if(!strcmp(word,"end")) {
+			printf("script: line %d: end without loop\n",i+1);
+			return 0;
+		} else if(!run_line(lines[i],iteration)) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+/*
+Run the commands in filename without prompting, one per line. Blank
+lines and lines starting with # are skipped.
+*/
+static int run_script( const char *filename )
+{
+	char line[1024];
+	char **lines;
+	int n=0, result;
+	FILE *file;
+
+	file = fopen(filename,"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	lines = malloc(SCRIPT_MAX_LINES*sizeof(char *));
+	if(!lines) {
+		fclose(file);
+		return 0;
+	}
+
+	while(n<SCRIPT_MAX_LINES && fgets(line,sizeof(line),file)) {
+		line[strcspn(line,"\r\n")] = 0;
+		lines[n] = strdup(line);
+		if(!lines[n]) break;
+		n++;
+	}
+	fclose(file);
+
+	result = run_lines(lines,0,n,0);
+
+	for(int i=0;i<n;i++) free(lines[i]);
+	free(lines);
+	return result;
+}
+
+/*
+Run one command. Returns 0 if it asks the shell to quit.
+*/
+static int do_command( const char *line )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	int inumber, result, args;
+
+	args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+	if(args<1) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		if(args==1) {
+			if(fs_format()) {
+				printf("disk formatted.\n");
 			} else {
-				printf("use: format\n");
-			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
+				printf("format failed!\n");
+			}
+		} else {
+			printf("use: format\n");
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				printf("disk mounted.\n");
 			} else {
-				printf("use: mount\n");
+				printf("mount failed!\n");
 			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
+		} else {
+			printf("use: mount\n");
+		}
+	} else if(!strcmp(cmd,"unmount")) {
+		if(args==1) {
+			if(fs_unmount()) {
+				printf("disk unmounted.\n");
 			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
+				printf("unmount failed!\n");
+			}
+		} else {
+			printf("use: unmount\n");
+		}
+	} else if(!strcmp(cmd,"sync")) {
+		if(args==1) {
+			if(fs_sync()) {
+				printf("disk synced.\n");
 			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
+				printf("sync failed!\n");
+			}
+		} else {
+			printf("use: sync\n");
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			printf("use: debug\n");
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = resolve(arg1,0);
+			result = inumber ? fs_getsize(inumber) : -1;
+			if(result>=0) {
+				printf("inode %d has size %d\n",inumber,result);
 			} else {
-				printf("use: create\n");
-			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
+				printf("getsize failed!\n");
+			}
+		} else {
+			printf("use: getsize <inumber|path>\n");
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				printf("created inode %d\n",inumber);
 			} else {
-				printf("use: delete <inumber>\n");
-			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
+				printf("create failed!\n");
+			}
+		} else {
+			printf("use: create\n");
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(dir_isdir(inumber)) {
+				printf("inode %d is a directory; use rm\n",inumber);
+			} else if(fs_delete(inumber)) {
+				printf("inode %d deleted.\n",inumber);
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("delete failed!\n");	
+			}
+		} else {
+			printf("use: delete <inumber>\n");
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = resolve(arg1,0);
+			if(!inumber || !do_copyout(inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
 			}
+		} else {
+			printf("use: cat <inumber|path>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			inumber = resolve(arg2,1);
+			if(inumber && do_copyin(arg1,inumber)) {
+				printf("copied file %s to inode %d\n",arg1,inumber);
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("copy failed!\n");
 			}
+		} else {
+			printf("use: copyin <filename> <inumber|path>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = resolve(arg1,0);
+			if(inumber && do_copyout(inumber,arg2)) {
+				printf("copied inode %d to file %s\n",inumber,arg2);
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
+				printf("copy failed!\n");
+			}
+		} else {
+			printf("use: copyout <inumber|path> <filename>\n");
+		}
+
+	} else if(!strcmp(cmd,"mkdir")) {
+		if(args==2) {
+			inumber = dir_mkdir(arg1);
+			if(inumber) {
+				printf("created directory %s at inode %d\n",arg1,inumber);
+			} else {
+				printf("mkdir failed!\n");
+			}
+		} else {
+			printf("use: mkdir <path>\n");
+		}
+
+	} else if(!strcmp(cmd,"touch")) {
+		if(args==2) {
+			inumber = dir_create(arg1);
+			if(inumber) {
+				printf("created %s at inode %d\n",arg1,inumber);
+			} else {
+				printf("touch failed!\n");
+			}
+		} else {
+			printf("use: touch <path>\n");
+		}
+
+	} else if(!strcmp(cmd,"rm")) {
+		if(args==2) {
+			if(dir_remove(arg1)) {
+				printf("%s removed.\n",arg1);
+			} else {
+				printf("rm failed!\n");
+			}
+		} else {
+			printf("use: rm <path>\n");
+		}
+
+	} else if(!strcmp(cmd,"ls")) {
+		if(args<=2) {
+			if(!dir_list(args==2 ? arg1 : "/",list_entry,0)) {
+				printf("ls failed!\n");
+			}
+		} else {
+			printf("use: ls [path]\n");
+		}
+
+	} else if(!strcmp(cmd,"stat")) {
+		if(args==2) {
+			int isdir = 0;
+			inumber = dir_lookup(arg1,&isdir);
+			if(inumber) {
+				printf("%s: %s at inode %d, size %d\n",arg1,isdir ? "directory" : "file",inumber,fs_getsize(inumber));
+			} else {
+				printf("stat failed!\n");
+			}
+		} else {
+			printf("use: stat <path>\n");
+		}
+
+	} else if(!strcmp(cmd,"stress")) {
+		if(args==3) {
+			inumber = atoi(arg1);
+			if(!do_stress(inumber,atoi(arg2))) {
+				printf("stress failed!\n");
+			}
+		} else {
+			printf("use: stress <inumber> <nthreads>\n");
+		}
+
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			stats_print();
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			stats_reset();
+			printf("stats reset.\n");
+		} else if(args>=2 && !strcmp(arg1,"json")) {
+			if(!do_stats_dump(args==3 ? arg2 : "/dev/stdout")) {
+				printf("stats dump failed!\n");
+			}
 		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			printf("use: stats [reset | json [file]]\n");
 		}
+
+	} else if(!strcmp(cmd,"help")) {
+		printf("Commands are:\n");
+		printf("    format\n");
+		printf("    mount\n");
+		printf("    unmount\n");
+		printf("    sync\n");
+		printf("    debug\n");
+		printf("    create\n");
+		printf("    delete  <inode>\n");
+		printf("    cat     <inode|path>\n");
+		printf("    copyin  <file> <inode|path>\n");
+		printf("    copyout <inode|path> <file>\n");
+		printf("    mkdir   <path>\n");
+		printf("    touch   <path>\n");
+		printf("    rm      <path>\n");
+		printf("    ls      [path]\n");
+		printf("    stat    <path>\n");
+		printf("    stress  <inode> <threads>\n");
+		printf("    stats   [reset | json [file]]\n");
+		printf("    repeat  <count> <command>\n");
+		printf("    timing  on|off\n");
+		printf("    help\n");
+		printf("    quit\n");
+		printf("    exit\n");
+	} else if(!strcmp(cmd,"quit")) {
+		return 0;
+	} else if(!strcmp(cmd,"exit")) {
+		return 0;
+	} else {
+		printf("unknown command: %s\n",cmd);
+		printf("type 'help' for a list of commands.\n");
 	}
 
-	printf("closing emulated disk.\n");
-	disk_close();
+	return 1;
+}
+
+/*
+Copies run as a pipeline: a reader thread fills a ring of COPY_RING
+buffers of copy_chunk bytes each while the calling thread empties them,
+so reading one side overlaps with writing the other. fill returns the
+bytes it read at offset, or 0 at the end; drain returns the bytes it
+wrote, and anything short of the whole buffer stops the copy. If the
+buffers or the thread cannot be had, the two take turns on one buffer.
+*/
+
+struct copy_pipe {
+	int (*fill)( void *ctx, char *data, int length, int offset );
+	int (*drain)( void *ctx, const char *data, int length, int offset );
+	void *fill_ctx;
+	void *drain_ctx;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buffers[COPY_RING];
+	int lengths[COPY_RING];
+	int head;	//oldest full buffer
+	int count;	//full buffers
+	int done;	//the reader has nothing more to add
+	int stopped;	//the writer has given up
+};
+
+static void * copy_reader( void *arg )
+{
+	struct copy_pipe *p = arg;
+	int offset=0, slot=0, length;
+
+	while(1) {
+		pthread_mutex_lock(&p->lock);
+		while(p->count==COPY_RING && !p->stopped) pthread_cond_wait(&p->cond,&p->lock);
+		int stopped = p->stopped;
+		pthread_mutex_unlock(&p->lock);
+		if(stopped) break;
+
+		length = p->fill(p->fill_ctx,p->buffers[slot],copy_chunk,offset);
+		if(length<=0) break;
+		offset += length;
 
+		pthread_mutex_lock(&p->lock);
+		p->lengths[slot] = length;
+		p->count++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		slot = (slot+1)%COPY_RING;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
 	return 0;
 }
 
+//copy everything fill produces into drain; returns the bytes drained
+static int copy_run( struct copy_pipe *p )
+{
+	pthread_t reader;
+	int offset=0, length, actual, nbuffers, started=0;
+	char *buffer;
+
+	for(nbuffers=0;nbuffers<COPY_RING;nbuffers++) {
+		p->buffers[nbuffers] = malloc(copy_chunk);
+		if(!p->buffers[nbuffers]) break;
+	}
+
+	if(nbuffers==COPY_RING) {
+		pthread_mutex_init(&p->lock,0);
+		pthread_cond_init(&p->cond,0);
+		p->head = p->count = p->done = p->stopped = 0;
+		started = !pthread_create(&reader,0,copy_reader,p);
+		if(!started) {
+			pthread_cond_destroy(&p->cond);
+			pthread_mutex_destroy(&p->lock);
+		}
+	}
+
+	if(started) {
+		while(1) {
+			pthread_mutex_lock(&p->lock);
+			while(!p->count && !p->done) pthread_cond_wait(&p->cond,&p->lock);
+			if(!p->count) {
+				pthread_mutex_unlock(&p->lock);
+				break;
+			}
+			buffer = p->buffers[p->head];
+			length = p->lengths[p->head];
+			pthread_mutex_unlock(&p->lock);
+
+			actual = p->drain(p->drain_ctx,buffer,length,offset);
+			if(actual>0) offset += actual;
+
+			pthread_mutex_lock(&p->lock);
+			p->head = (p->head+1)%COPY_RING;
+			p->count--;
+			if(actual!=length) p->stopped = 1;
+			pthread_cond_broadcast(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+			if(actual!=length) break;
+		}
+		pthread_join(reader,0);
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+	} else {
+		int size = nbuffers ? copy_chunk : COPY_CHUNK_MIN;
+		buffer = nbuffers ? p->buffers[0] : malloc(size);
+		while(buffer && (length = p->fill(p->fill_ctx,buffer,size,offset))>0) {
+			actual = p->drain(p->drain_ctx,buffer,length,offset);
+			if(actual>0) offset += actual;
+			if(actual!=length) break;
+		}
+		if(!nbuffers) free(buffer);
+	}
+
+	for(int i=0;i<nbuffers;i++) free(p->buffers[i]);
+	return offset;
+}
+
+static int host_fill( void *ctx, char *data, int length, int offset )
+{
+	return fread(data,1,length,ctx);
+}
+
+static int host_drain( void *ctx, const char *data, int length, int offset )
+{
+	return fwrite(data,1,length,ctx);
+}
+
+static int fs_fill( void *ctx, char *data, int length, int offset )
+{
+	return fs_pread(*(int *)ctx,data,length,offset);
+}
+
+static int fs_drain( void *ctx, const char *data, int length, int offset )
+{
+	int actual = fs_pwrite(*(int *)ctx,data,length,offset);
+
+	if(actual<0) {
+		printf("ERROR: fs_write return invalid result %d\n",actual);
+	} else if(actual!=length) {
+		printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,length);
+	}
+	return actual;
+}
+
+/*
+Commands that take an inode also take a path, told apart by its leading
+slash. copyin makes the file if the path does not name one yet. Either
+way a directory is refused, since writing it as a file would wreck it.
+*/
+static int resolve( const char *arg, int create )
+{
+	int isdir = 0;
+
+	if(arg[0]!='/') {
+		int inumber = atoi(arg);
+		if(dir_isdir(inumber)) {
+			printf("inode %d is a directory\n",inumber);
+			return 0;
+		}
+		return inumber;
+	}
+
+	int inumber = dir_lookup(arg,&isdir);
+	if(!inumber && create) return dir_create(arg);
+	if(!inumber) {
+		printf("%s: no such file\n",arg);
+	} else if(isdir) {
+		printf("%s is a directory\n",arg);
+		return 0;
+	}
+	return inumber;
+}
+
+static void list_entry( void *ctx, const char *name, int inumber, int isdir )
+{
+	printf("%8d %10d %s%s\n",inumber,fs_getsize(inumber),name,isdir ? "/" : "");
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
+	struct copy_pipe p;
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int offset, fd;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -178,50 +697,132 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
-			}
-		}
+	fd = fs_open(inumber);
+	if(fd<0) {
+		fclose(file);
+		return 0;
 	}
 
+	p.fill = host_fill;
+	p.fill_ctx = file;
+	p.drain = fs_drain;
+	p.drain_ctx = &fd;
+	offset = copy_run(&p);
+
 	printf("%d bytes copied\n",offset);
 
+	fs_close(fd);
 	fclose(file);
 	return 1;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
+	struct copy_pipe p;
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int offset, fd;
+
+	fd = fs_open(inumber);
+	if(fd<0) return 0;
 
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(fd);
 		return 0;
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
-	}
+	p.fill = fs_fill;
+	p.fill_ctx = &fd;
+	p.drain = host_drain;
+	p.drain_ctx = file;
+	offset = copy_run(&p);
 
 	printf("%d bytes copied\n",offset);
 
+	fs_close(fd);
 	fclose(file);
 	return 1;
-}
\ No newline at end of file
+}
+
+static int do_stats_dump( const char *filename )
+{
+	FILE *file;
+
+	file = fopen(filename,"w");
+	if(!file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	stats_dump(file);
+	fclose(file);
+	return 1;
+}
+
+struct stress_arg {
+	int inumber;
+	int passes;
+	long bytes;
+};
+
+//read the whole file passes times through a handle of our own
+static void * stress_reader( void *p )
+{
+	struct stress_arg *arg = p;
+	char buffer[65536];
+	int fd, offset, result;
+
+	fd = fs_open(arg->inumber);
+	if(fd<0) return 0;
+
+	for(int pass=0;pass<arg->passes;pass++) {
+		offset = 0;
+		while((result = fs_pread(fd,buffer,sizeof(buffer),offset))>0) {
+			offset += result;
+		}
+		arg->bytes += offset;
+	}
+
+	fs_close(fd);
+	return 0;
+}
+
+/*
+Read one file from nthreads threads at once and report the combined
+throughput, to see how reads scale with the number of threads.
+*/
+static int do_stress( int inumber, int nthreads )
+{
+	pthread_t threads[STRESS_MAX_THREADS];
+	struct stress_arg args[STRESS_MAX_THREADS];
+	struct timespec start, end;
+	long total=0;
+	int size, started;
+
+	if(nthreads<1 || nthreads>STRESS_MAX_THREADS) {
+		printf("stress: use 1 to %d threads\n",STRESS_MAX_THREADS);
+		return 0;
+	}
+
+	size = fs_getsize(inumber);
+	if(size<=0) return 0;
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(started=0;started<nthreads;started++) {
+		args[started].inumber = inumber;
+		args[started].passes = (STRESS_BYTES + size - 1) / size;
+		args[started].bytes = 0;
+		if(pthread_create(&threads[started],0,stress_reader,&args[started])) break;
+	}
+	for(int t=0;t<started;t++) {
+		pthread_join(threads[t],0);
+		total += args[t].bytes;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("stress: %d threads read %ld bytes in %.3f s (%.1f MB/s)\n",
+		started,total,seconds,total / seconds / (1 << 20));
+	return started==nthreads;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_BUCKETS 40	//bucket b counts latencies in [2^b, 2^(b+1)) ns
+
+struct stats_counter {
+	long calls;
+	long bytes;
+	long ios;
+	long total_ns;
+	long max_ns;
+	long buckets[STATS_BUCKETS];
+};
+
+static const char *names[STATS_NOPS] = {
+	"fs_mount",
+	"fs_create",
+	"fs_delete",
+	"fs_getsize",
+	"fs_read",
+	"fs_write",
+	"fs_pread",
+	"fs_pwrite",
+	"disk_read",
+	"disk_write",
+	"disk_readv",
+	"disk_writev",
+	"disk_wait",
+	"disk_flush",
+};
+
+//updated without locks; a reader may see one call half counted
+static struct stats_counter counters[STATS_NOPS];
+
+//block I/Os done by this thread, so each operation can take the difference
+static __thread long thread_ios;
+
+static long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_begin( struct stats_timer *t )
+{
+	t->ios = thread_ios;
+	t->start = now_ns();
+}
+
+void stats_end( int op, struct stats_timer *t, long bytes )
+{
+	struct stats_counter *c = &counters[op];
+	long ns = now_ns() - t->start;
+	long max = __atomic_load_n(&c->max_ns,__ATOMIC_RELAXED);
+	int b = ns > 1 ? 63 - __builtin_clzl(ns) : 0;
+
+	if(b>=STATS_BUCKETS) b = STATS_BUCKETS-1;
+
+	__atomic_fetch_add(&c->calls,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->bytes,bytes,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->ios,thread_ios - t->ios,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->total_ns,ns,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->buckets[b],1,__ATOMIC_RELAXED);
+	while(ns>max && !__atomic_compare_exchange_n(&c->max_ns,&max,ns,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+void stats_io( int nblocks )
+{
+	thread_ios += nblocks;
+}
+
+//copy out a consistent enough view of one counter
+static void snapshot( int op, struct stats_counter *c )
+{
+	c->calls = __atomic_load_n(&counters[op].calls,__ATOMIC_RELAXED);
+	c->bytes = __atomic_load_n(&counters[op].bytes,__ATOMIC_RELAXED);
+	c->ios = __atomic_load_n(&counters[op].ios,__ATOMIC_RELAXED);
+	c->total_ns = __atomic_load_n(&counters[op].total_ns,__ATOMIC_RELAXED);
+	c->max_ns = __atomic_load_n(&counters[op].max_ns,__ATOMIC_RELAXED);
+	for(int b=0;b<STATS_BUCKETS;b++) c->buckets[b] = __atomic_load_n(&counters[op].buckets[b],__ATOMIC_RELAXED);
+}
+
+//upper bound of the bucket holding the pth percentile, in nanoseconds
+static long percentile( struct stats_counter *c, int p )
+{
+	long total = 0, seen = 0;
+
+	for(int b=0;b<STATS_BUCKETS;b++) total += c->buckets[b];
+	if(!total) return 0;
+	for(int b=0;b<STATS_BUCKETS;b++) {
+		seen += c->buckets[b];
+		if(seen*100>=total*p) return (2L << b) < c->max_ns ? 2L << b : c->max_ns;
+	}
+	return c->max_ns;
+}
+
+void stats_print()
+{
+	struct stats_counter c;
+
+	printf("%-12s %10s %12s %10s %10s %10s %10s %10s\n",
+		"operation","calls","bytes","block I/O","mean us","p50 us","p99 us","max us");
+	for(int op=0;op<STATS_NOPS;op++) {
+		snapshot(op,&c);
+		if(!c.calls) continue;
+		printf("%-12s %10ld %12ld %10ld %10.1f %10.1f %10.1f %10.1f\n",
+			names[op],c.calls,c.bytes,c.ios,
+			c.total_ns / 1e3 / c.calls,percentile(&c,50) / 1e3,percentile(&c,99) / 1e3,c.max_ns / 1e3);
+	}
+}
+
+//the whole lot, histograms included, as one JSON object
+void stats_dump( FILE *file )
+{
+	struct stats_counter c;
+
+	fprintf(file,"{\"operations\": [");
+	for(int op=0;op<STATS_NOPS;op++) {
+		snapshot(op,&c);
+		fprintf(file,"%s\n  {\"name\": \"%s\", \"calls\": %ld, \"bytes\": %ld, \"block_ios\": %ld, "
+			"\"total_ns\": %ld, \"max_ns\": %ld, \"p50_ns\": %ld, \"p99_ns\": %ld, \"histogram_ns\": {",
+			op ? "," : "",names[op],c.calls,c.bytes,c.ios,c.total_ns,c.max_ns,percentile(&c,50),percentile(&c,99));
+		int first = 1;
+		for(int b=0;b<STATS_BUCKETS;b++) {
+			if(!c.buckets[b]) continue;
+			fprintf(file,"%s\"%ld\": %ld",first ? "" : ", ",2L << b,c.buckets[b]);
+			first = 0;
+		}
+		fprintf(file,"}}");
+	}
+	fprintf(file,"\n]}\n");
+	fflush(file);
+}
+
+void stats_reset()
+{
+	for(int op=0;op<STATS_NOPS;op++) {
+		__atomic_store_n(&counters[op].calls,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&counters[op].bytes,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&counters[op].ios,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&counters[op].total_ns,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&counters[op].max_ns,0,__ATOMIC_RELAXED);
+		for(int b=0;b<STATS_BUCKETS;b++) __atomic_store_n(&counters[op].buckets[b],0,__ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+Counters for the fs entry points and the disk primitives. Each operation
+is bracketed by stats_begin and stats_end, which record the call, the
+bytes it moved, the block I/Os it caused and how long it took, in a
+histogram of power-of-two nanosecond buckets. Block I/Os are reported
+by the disk layer through stats_io and charged to whatever operation is
+running on the same thread.
+*/
+
+enum stats_op {
+	STATS_FS_MOUNT,
+	STATS_FS_CREATE,
+	STATS_FS_DELETE,
+	STATS_FS_GETSIZE,
+	STATS_FS_READ,
+	STATS_FS_WRITE,
+	STATS_FS_PREAD,
+	STATS_FS_PWRITE,
+	STATS_DISK_READ,
+	STATS_DISK_WRITE,
+	STATS_DISK_READV,
+	STATS_DISK_WRITEV,
+	STATS_DISK_WAIT,
+	STATS_DISK_FLUSH,
+	STATS_NOPS
+};
+
+struct stats_timer {
+	long start;
+	long ios;
+};
+
+void stats_begin( struct stats_timer *t );
+void stats_end( int op, struct stats_timer *t, long bytes );
+void stats_io( int nblocks );
+
+void stats_print();
+void stats_dump( FILE *file );
+void stats_reset();
+
+#endif